@@ -4,9 +4,9 @@ TARGET = appload
 TEMPLATE = app
 
 SOURCES +=  src/main.cpp src/management.cpp src/AppLoad.cpp src/AppLoadCoordinator.cpp src/library.cpp src/libraryexternals.cpp \
-            src/qtfb/fbmanagement.cpp src/qtfb/FBController.cpp
+            src/qtfb/fbmanagement.cpp src/qtfb/FBController.cpp src/qtfb/shmpool.cpp src/qtfb/snapshots.cpp src/qtfb/thumbnails.cpp
 
 HEADERS +=  src/AppLoad.h src/AppLoadCoordinator.h src/library.h src/AppLibrary.h \
-            src/qtfb/FBController.h src/qtfb/fbmanagement.h
+            src/qtfb/FBController.h src/qtfb/fbmanagement.h src/qtfb/shmpool.h src/qtfb/snapshots.h src/qtfb/thumbnails.h
 
 RESOURCES += resources/resources.qrc
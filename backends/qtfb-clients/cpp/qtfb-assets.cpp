@@ -0,0 +1,198 @@
+#include "qtfb-assets.h"
+#include "qtfb-pixels.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define RETURN_ERROR(code) { if(error) *error = code; return NULL; }
+
+// Two formats share a memory layout if one can be memcpy'd into the other.
+static bool sameLayout(uint8_t a, uint8_t b) {
+    return qtfb::isRGB565(a) == qtfb::isRGB565(b) && qtfb::bytesPerPixel(a) == qtfb::bytesPerPixel(b);
+}
+
+qtfb::MappedAsset *qtfb::MappedAsset::_map(const char *path, int *error) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1) RETURN_ERROR(QTFB_ERROR_ASSET_OPEN);
+    struct stat info;
+    if(fstat(fd, &info) == -1 || info.st_size == 0) {
+        close(fd);
+        RETURN_ERROR(QTFB_ERROR_ASSET_SIZE);
+    }
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive.
+    close(fd);
+    if(mapping == MAP_FAILED) RETURN_ERROR(QTFB_ERROR_ASSET_MAP);
+
+    MappedAsset *asset = new MappedAsset();
+    asset->_mapping = mapping;
+    asset->_mappingSize = info.st_size;
+    return asset;
+}
+
+qtfb::MappedAsset *qtfb::MappedAsset::open(const char *path, int *error) {
+    MappedAsset *asset = _map(path, error);
+    if(!asset) return NULL;
+    if(!asset->_parseHeader()) {
+        delete asset;
+        RETURN_ERROR(QTFB_ERROR_ASSET_HEADER);
+    }
+    return asset;
+}
+
+qtfb::MappedAsset *qtfb::MappedAsset::openRaw(const char *path, int width, int height, uint8_t format, size_t stride, size_t offset, int *error) {
+    MappedAsset *asset = _map(path, error);
+    if(!asset) return NULL;
+    if(!asset->_setLayout(width, height, format, stride, offset)) {
+        delete asset;
+        RETURN_ERROR(QTFB_ERROR_ASSET_SIZE);
+    }
+    return asset;
+}
+
+qtfb::MappedAsset::~MappedAsset() {
+    if(_mapping) munmap(_mapping, _mappingSize);
+}
+
+bool qtfb::MappedAsset::_setLayout(int width, int height, uint8_t format, size_t stride, size_t offset) {
+    if(width <= 0 || height <= 0) return false;
+    size_t rowSize = (size_t) width * bytesPerPixel(format);
+    if(stride == 0) stride = rowSize;
+    if(stride < rowSize) return false;
+    // The last row doesn't need its padding.
+    if(offset > _mappingSize || (height - 1) * stride + rowSize > _mappingSize - offset) return false;
+    _width = width;
+    _height = height;
+    _format = format;
+    _stride = stride;
+    _pixels = (const uint8_t *) _mapping + offset;
+    return true;
+}
+
+// Reads the next whitespace-separated token of a netpbm header, skipping comments.
+static bool nextToken(const char *&position, const char *end, char *token, size_t tokenSize) {
+    for(;;) {
+        while(position < end && strchr(" \t\r\n", *position)) position++;
+        if(position < end && *position == '#') {
+            while(position < end && *position != '\n') position++;
+            continue;
+        }
+        break;
+    }
+    size_t length = 0;
+    while(position < end && !strchr(" \t\r\n", *position)) {
+        if(length + 1 >= tokenSize) return false;
+        token[length++] = *position++;
+    }
+    token[length] = 0;
+    return length > 0;
+}
+
+bool qtfb::MappedAsset::_parseHeader() {
+    const char *position = (const char *) _mapping, *end = position + std::min(_mappingSize, (size_t) 4096);
+    char token[32];
+    if(!nextToken(position, end, token, sizeof(token))) return false;
+
+    int width = 0, height = 0, maxValue = 0, depth = 0;
+    if(strcmp(token, "P6") == 0) {
+        for(int *value : { &width, &height, &maxValue }) {
+            if(!nextToken(position, end, token, sizeof(token))) return false;
+            *value = atoi(token);
+        }
+        depth = 3;
+    } else if(strcmp(token, "P7") == 0) {
+        for(;;) {
+            if(!nextToken(position, end, token, sizeof(token))) return false;
+            if(strcmp(token, "ENDHDR") == 0) break;
+            char value[32];
+            if(!nextToken(position, end, value, sizeof(value))) return false;
+            if(strcmp(token, "WIDTH") == 0) width = atoi(value);
+            else if(strcmp(token, "HEIGHT") == 0) height = atoi(value);
+            else if(strcmp(token, "DEPTH") == 0) depth = atoi(value);
+            else if(strcmp(token, "MAXVAL") == 0) maxValue = atoi(value);
+        }
+    } else {
+        return false;
+    }
+    // Exactly one whitespace character separates the header from the pixels.
+    if(position >= end) return false;
+    position++;
+
+    if(maxValue != 255 || (depth != 3 && depth != 4)) return false;
+    uint8_t format = depth == 3 ? FBFMT_RMPP_RGB888 : FBFMT_RMPP_RGBA8888;
+    return _setLayout(width, height, format, 0, position - (const char *) _mapping);
+}
+
+void qtfb::MappedAsset::prefetch(const DamageRect *source) const {
+    int top = source ? std::max(0, source->y) : 0;
+    int bottom = source ? std::min(_height, source->y + source->h) : _height;
+    if(top >= bottom) return;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) (_pixels + top * _stride) & ~(uintptr_t) (pageSize - 1);
+    uintptr_t stop = (uintptr_t) (_pixels + (bottom - 1) * _stride + _width * bytesPerPixel(_format));
+    madvise((void *) start, stop - start, MADV_WILLNEED);
+}
+
+// RGB888 has no vectorized conversion - it's only the odd PPM which needs it.
+static void convertFromRGB888(const uint8_t *source, size_t sourceStride,
+                              uint8_t *destination, size_t destinationStride, uint8_t format,
+                              int width, int height) {
+    bool rgb565 = qtfb::isRGB565(format);
+    for(int y = 0; y < height; y++) {
+        const uint8_t *in = source + y * sourceStride;
+        uint8_t *out = destination + y * destinationStride;
+        for(int x = 0; x < width; x++, in += 3) {
+            if(rgb565) {
+                ((uint16_t *) out)[x] = ((in[0] >> 3) << 11) | ((in[1] >> 2) << 5) | (in[2] >> 3);
+            } else {
+                out[x * 4] = in[0];
+                out[x * 4 + 1] = in[1];
+                out[x * 4 + 2] = in[2];
+                out[x * 4 + 3] = 255;
+            }
+        }
+    }
+}
+
+bool qtfb::MappedAsset::draw(uint8_t *surface, int surfaceWidth, int surfaceHeight, size_t surfaceStride, uint8_t surfaceFormat,
+                             int x, int y, const DamageRect *source, DamageRegion *damage) const {
+    DamageRect from = source ? *source : DamageRect { 0, 0, _width, _height };
+    // Clip against the asset first, then the surface.
+    int left = std::max(0, from.x), top = std::max(0, from.y);
+    x += left - from.x;
+    y += top - from.y;
+    from = { left, top, std::min(_width, from.x + from.w) - left, std::min(_height, from.y + from.h) - top };
+    if(x < 0) { from.x -= x; from.w += x; x = 0; }
+    if(y < 0) { from.y -= y; from.h += y; y = 0; }
+    from.w = std::min(from.w, surfaceWidth - x);
+    from.h = std::min(from.h, surfaceHeight - y);
+    if(from.w <= 0 || from.h <= 0) return true;
+
+    const uint8_t *in = _pixels + from.y * _stride + from.x * bytesPerPixel(_format);
+    uint8_t *out = surface + y * surfaceStride + x * bytesPerPixel(surfaceFormat);
+    // Whole rows are read front to back - let readahead work in big chunks.
+    if(from.w == _width) {
+        madvise((void *) ((uintptr_t) in & ~(uintptr_t) (sysconf(_SC_PAGESIZE) - 1)), from.h * _stride, MADV_SEQUENTIAL);
+    }
+
+    if(sameLayout(_format, surfaceFormat)) {
+        copyPixels(in, _stride, out, surfaceStride, surfaceFormat, from.w, from.h);
+    } else if(isRGB565(_format)) {
+        return false;
+    } else if(bytesPerPixel(_format) == 4) {
+        convertFromRGBA8888(in, _stride, out, surfaceStride, surfaceFormat, from.w, from.h);
+    } else {
+        convertFromRGB888(in, _stride, out, surfaceStride, surfaceFormat, from.w, from.h);
+    }
+    if(damage) damage->add(x, y, from.w, from.h);
+    return true;
+}
+
+bool qtfb::MappedAsset::draw(ClientConnection &connection, int x, int y, const DamageRect *source, DamageRegion *damage) const {
+    return draw(connection.shm, connection.width(), connection.height(), connection.stride(), connection.format(), x, y, source, damage);
+}
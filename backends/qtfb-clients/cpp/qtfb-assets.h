@@ -0,0 +1,62 @@
+#pragma once
+#include "qtfb-client.h"
+#include "qtfb-damage.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Uncompressed images mapped straight from disk, and drawn into a qtfb surface without an
+// intermediate copy. The kernel pages the file in as it is read, so a full-screen image
+// never needs a second screen-sized buffer.
+//
+//   qtfb::MappedAsset *page = qtfb::MappedAsset::open("page.ppm");
+//   page->draw(connection, 0, 0, NULL, &damage);
+//
+// Understood formats are binary PPM (P6, RGB888), PAM (P7, RGB or RGB_ALPHA) and headerless
+// raw pixels through openRaw(). Assets may be in any of the qtfb formats, and are converted
+// to the surface's format while drawing - except from RGB565, which is only ever copied.
+#define QTFB_ERROR_ASSET_OPEN -20
+#define QTFB_ERROR_ASSET_MAP -21
+#define QTFB_ERROR_ASSET_HEADER -22
+#define QTFB_ERROR_ASSET_SIZE -23
+
+namespace qtfb {
+    class MappedAsset {
+    public:
+        // Returns NULL (and the QTFB_ERROR_ASSET_* code through error) on failure.
+        static MappedAsset *open(const char *path, int *error = NULL);
+        // stride 0 means tightly packed rows. offset skips a header of that many bytes.
+        static MappedAsset *openRaw(const char *path, int width, int height, uint8_t format,
+                                    size_t stride = 0, size_t offset = 0, int *error = NULL);
+        ~MappedAsset();
+
+        int width() const { return _width; }
+        int height() const { return _height; }
+        uint8_t format() const { return _format; }
+        size_t stride() const { return _stride; }
+        const uint8_t *pixels() const { return _pixels; }
+
+        // Asks the kernel to start reading the (part of the) asset in, for example the next
+        // page of a slideshow while the current one is shown.
+        void prefetch(const DamageRect *source = NULL) const;
+
+        // Draws the source rect (the whole asset if NULL) of the asset with its top left corner
+        // at x, y, clipped to the surface. Returns false if the formats can't be converted.
+        bool draw(uint8_t *surface, int surfaceWidth, int surfaceHeight, size_t surfaceStride, uint8_t surfaceFormat,
+                  int x, int y, const DamageRect *source = NULL, DamageRegion *damage = NULL) const;
+        bool draw(ClientConnection &connection, int x, int y, const DamageRect *source = NULL, DamageRegion *damage = NULL) const;
+
+    private:
+        MappedAsset() {}
+
+        void *_mapping = NULL;
+        size_t _mappingSize = 0;
+        const uint8_t *_pixels = NULL;
+        int _width = 0, _height = 0;
+        size_t _stride = 0;
+        uint8_t _format = 0;
+
+        static MappedAsset *_map(const char *path, int *error);
+        bool _parseHeader();
+        bool _setLayout(int width, int height, uint8_t format, size_t stride, size_t offset);
+    };
+}
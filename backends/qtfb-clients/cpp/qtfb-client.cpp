@@ -1,19 +1,76 @@
 #include "qtfb-client.h"
 #include <iostream>
 #include <fcntl.h>
+#include <poll.h>
+
+unsigned int qtfb::bytesPerPixel(uint8_t shmType) {
+    switch(shmType) {
+        case FBFMT_RMPP_RGB888:
+        case FBFMT_RMPPM_RGB888:
+            return 3;
+        case FBFMT_RMPP_RGBA8888:
+        case FBFMT_RMPPM_RGBA8888:
+            return 4;
+        default:
+            return 2;
+    }
+}
 
 qtfb::ClientConnection::ClientConnection(qtfb::FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution, bool nonBlocking) {
-    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    int status = _connect(framebufferID, shmType, customResolution, nonBlocking);
+    if(status != QTFB_OK) {
+        exit(status);
+    }
+}
+
+qtfb::ClientConnection *qtfb::ClientConnection::create(qtfb::FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution, bool nonBlocking, int *error) {
+    ClientConnection *connection = new ClientConnection();
+    int status = connection->_connect(framebufferID, shmType, customResolution, nonBlocking);
+    if(error) *error = status;
+    if(status != QTFB_OK) {
+        delete connection;
+        return NULL;
+    }
+    return connection;
+}
+
+int qtfb::ClientConnection::_openSocket(int &sock) {
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
     if(sock == -1) {
         std::cout << "Failed to initialize the socket!" << std::endl;
-        exit(-1);
+        return QTFB_ERROR_SOCKET;
     }
     struct sockaddr_un addr;
     addr.sun_family = AF_UNIX;
     strncpy(addr.sun_path, SOCKET_PATH, sizeof(addr.sun_path) - 1);
     if(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
         std::cout << "Failed to connect. " << errno << std::endl;
-        exit(-2);
+        close(sock);
+        return QTFB_ERROR_CONNECT;
+    }
+    return QTFB_OK;
+}
+
+int qtfb::ClientConnection::_setNonBlocking(int sock) {
+    // Make the fd non-blocking for easier polling
+    int status = fcntl(sock, F_GETFL, 0);
+    if(status == -1) {
+        std::cout << "Failed to get socket status!" << std::endl;
+        return QTFB_ERROR_SOCKET_STATUS;
+    }
+    status = fcntl(sock, F_SETFL, status | O_NONBLOCK);
+    if(status == -1) {
+        std::cout << "Failed to set socket nonblock!" << std::endl;
+        return QTFB_ERROR_SOCKET_NONBLOCK;
+    }
+    return QTFB_OK;
+}
+
+int qtfb::ClientConnection::_connect(qtfb::FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution, bool nonBlocking) {
+    int sock;
+    int status = _openSocket(sock);
+    if(status != QTFB_OK) {
+        return status;
     }
 
     // Ask to be connected to the main framebuffer.
@@ -60,27 +117,20 @@ qtfb::ClientConnection::ClientConnection(qtfb::FBKey framebufferID, uint8_t shmT
     }
     if(send(sock, &initMessage, sizeof(initMessage), 0) == -1) {
         std::cout << "Failed to send init message!" << std::endl;
-        exit(-3);
+        close(sock);
+        return QTFB_ERROR_SEND_INIT;
     }
 
     qtfb::ServerMessage incomingInitConfirm;
     if(recv(sock, &incomingInitConfirm, sizeof(incomingInitConfirm), 0) < 1) {
         std::cout << "Failed to recv init message!" << std::endl;
-        exit(-4);
+        close(sock);
+        return QTFB_ERROR_RECV_INIT;
     }
 
-    if(nonBlocking){
-        // Make the fd non-blocking for easier polling
-        int status = fcntl(fd, F_GETFL, 0);
-        if(status == -1) {
-            std::cout << "Failed to get socket status!" << std::endl;
-            exit(-7);
-        }
-        status = fcntl(fd, F_SETFL, status | O_NONBLOCK);
-        if(status == -1) {
-            std::cout << "Failed to set socket nonblock!" << std::endl;
-            exit(-8);
-        }
+    if(nonBlocking && (status = _setNonBlocking(sock)) != QTFB_OK) {
+        close(sock);
+        return status;
     }
 
     FORMAT_SHM(shmName, incomingInitConfirm.init.shmKeyDefined);
@@ -88,22 +138,158 @@ qtfb::ClientConnection::ClientConnection(qtfb::FBKey framebufferID, uint8_t shmT
     int fd = shm_open(shmName, O_RDWR, 0);
     if(fd == -1) {
         std::cout << "Failed to get shm!" << std::endl;
-        exit(-5);
+        close(sock);
+        return QTFB_ERROR_SHM_OPEN;
     }
 
     unsigned char *memory = (unsigned char *) mmap(NULL, incomingInitConfirm.init.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
     if(memory == MAP_FAILED) {
         std::cout << "Failed to mmap() shm!" << std::endl;
-        exit(-6);
+        close(fd);
+        close(sock);
+        return QTFB_ERROR_SHM_MAP;
     }
     this->shmFD = fd;
     this->fd = sock;
+    _shmKey = incomingInitConfirm.init.shmKeyDefined;
+    _format = shmType;
+    _stride = _width * bytesPerPixel(shmType);
     shm = memory;
     shmSize = incomingInitConfirm.init.shmSize;
+    return QTFB_OK;
+}
+
+qtfb::ClientConnection *qtfb::ClientConnection::importBuffers(qtfb::FBKey framebufferID, uint8_t shmType, uint16_t width, uint16_t height, const std::vector<Buffer> &buffers, bool nonBlocking, int *error) {
+    ClientConnection *connection = new ClientConnection();
+    int status = connection->_import(framebufferID, shmType, width, height, buffers, nonBlocking);
+    if(error) *error = status;
+    if(status != QTFB_OK) {
+        delete connection;
+        return NULL;
+    }
+    return connection;
+}
+
+int qtfb::ClientConnection::_import(qtfb::FBKey framebufferID, uint8_t shmType, uint16_t width, uint16_t height, const std::vector<Buffer> &buffers, bool nonBlocking) {
+    if(buffers.empty() || buffers.size() > QTFB_MAX_IMPORTED_BUFFERS) {
+        return QTFB_ERROR_SEND_IMPORT;
+    }
+    int sock;
+    int status = _openSocket(sock);
+    if(status != QTFB_OK) {
+        return status;
+    }
+
+    for(size_t slot = 0; slot < buffers.size(); slot++) {
+        qtfb::ClientMessage importMessage = {
+            .type = MESSAGE_IMPORT_BUFFER,
+            .importBuffer = {
+                .framebufferKey = framebufferID,
+                .framebufferType = shmType,
+                .slot = (uint8_t) slot,
+                .width = width,
+                .height = height,
+                .stride = buffers[slot].stride,
+                .offset = buffers[slot].offset,
+            },
+        };
+        struct iovec data = {
+            .iov_base = &importMessage,
+            .iov_len = sizeof(importMessage),
+        };
+        union {
+            char buffer[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr header = {};
+        header.msg_iov = &data;
+        header.msg_iovlen = 1;
+        header.msg_control = control.buffer;
+        header.msg_controllen = sizeof(control.buffer);
+        struct cmsghdr *item = CMSG_FIRSTHDR(&header);
+        item->cmsg_level = SOL_SOCKET;
+        item->cmsg_type = SCM_RIGHTS;
+        item->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(item), &buffers[slot].fd, sizeof(int));
+        if(sendmsg(sock, &header, MSG_NOSIGNAL) != sizeof(importMessage)) {
+            std::cout << "Failed to send import message!" << std::endl;
+            close(sock);
+            return QTFB_ERROR_SEND_IMPORT;
+        }
+
+        qtfb::ServerMessage incomingImportConfirm;
+        for(;;) {
+            if(recv(sock, &incomingImportConfirm, sizeof(incomingImportConfirm), 0) < 1) {
+                std::cout << "The server rejected the imported buffer!" << std::endl;
+                close(sock);
+                return QTFB_ERROR_IMPORT_REJECTED;
+            }
+            if(incomingImportConfirm.type == MESSAGE_IMPORT_BUFFER) break;
+            // The visibility is sent right after the first import is confirmed.
+            if(incomingImportConfirm.type == MESSAGE_VISIBILITY) {
+                _visibility = incomingImportConfirm.visibility.state;
+            }
+            _pendingMessages.push_back(incomingImportConfirm);
+        }
+    }
+
+    if(nonBlocking && (status = _setNonBlocking(sock)) != QTFB_OK) {
+        close(sock);
+        return status;
+    }
+    this->fd = sock;
+    _width = width;
+    _height = height;
+    _format = shmType;
+    _stride = buffers[0].stride;
+    _shmKey = -1;
+    return QTFB_OK;
+}
+
+int qtfb::ClientConnection::createBuffer(size_t size) {
+    int bufferFD = memfd_create("qtfb-buffer", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(bufferFD == -1) {
+        return -1;
+    }
+    if(ftruncate(bufferFD, size) == -1 || fcntl(bufferFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        close(bufferFD);
+        return -1;
+    }
+    return bufferFD;
+}
+
+bool qtfb::ClientConnection::presentBuffer(int slot) {
+    _useFrameCredit();
+    return _send({
+            .type = MESSAGE_PRESENT_BUFFER,
+            .presentBuffer = {
+                .slot = slot,
+                .update = {
+                    .type = UPDATE_ALL,
+                },
+            },
+        });
+}
+
+bool qtfb::ClientConnection::presentBuffer(int slot, int x, int y, int w, int h) {
+    _useFrameCredit();
+    return _send({
+            .type = MESSAGE_PRESENT_BUFFER,
+            .presentBuffer = {
+                .slot = slot,
+                .update = {
+                    .type = UPDATE_PARTIAL,
+                    .x = x, .y = y, .w = w, .h = h,
+                },
+            },
+        });
 }
 
 qtfb::ClientConnection::~ClientConnection() {
-    munmap(shm, shmSize);
+    // Never connected (a failed create())
+    if(fd == -1) return;
+    if(shm != NULL) munmap(shm, shmSize);
+    _unmapOverlay();
     qtfb::ClientMessage terminateMessage = {
         .type = MESSAGE_TERMINATE,
     };
@@ -114,13 +300,18 @@ qtfb::ClientConnection::~ClientConnection() {
 
 unsigned short qtfb::ClientConnection::width() const { return _width; }
 unsigned short qtfb::ClientConnection::height() const { return _height; }
+unsigned int qtfb::ClientConnection::stride() const { return _stride; }
+uint8_t qtfb::ClientConnection::format() const { return _format; }
+int qtfb::ClientConnection::visibility() const { return _visibility; }
+int qtfb::ClientConnection::socketFD() const { return fd; }
 
-void qtfb::ClientConnection::_send(const struct ClientMessage &msg) {
-    send(fd, &msg, sizeof(msg), 0);
+bool qtfb::ClientConnection::_send(const struct ClientMessage &msg) {
+    return send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg);
 }
 
-void qtfb::ClientConnection::sendCompleteUpdate(){
-    _send({
+bool qtfb::ClientConnection::sendCompleteUpdate(){
+    _useFrameCredit();
+    return _send({
             .type = MESSAGE_UPDATE,
             .update = {
                 .type = UPDATE_ALL,
@@ -128,8 +319,9 @@ void qtfb::ClientConnection::sendCompleteUpdate(){
         });
 }
 
-void qtfb::ClientConnection::sendPartialUpdate(int x, int y, int w, int h) {
-    _send({
+bool qtfb::ClientConnection::sendPartialUpdate(int x, int y, int w, int h) {
+    _useFrameCredit();
+    return _send({
             .type = MESSAGE_UPDATE,
             .update = {
                 .type = UPDATE_PARTIAL,
@@ -138,13 +330,289 @@ void qtfb::ClientConnection::sendPartialUpdate(int x, int y, int w, int h) {
         });
 }
 
+bool qtfb::ClientConnection::requestReconfigure(uint8_t shmType, uint16_t width, uint16_t height) {
+    return _send({
+            .type = MESSAGE_RECONFIGURE,
+            .reconfigure = {
+                .framebufferType = shmType,
+                .width = width,
+                .height = height,
+            },
+        });
+}
+
+bool qtfb::ClientConnection::_applyReconfigure(const struct ReconfigureMessageResponseContents &reconfigure) {
+    // The server keeps the same SHM object when it can - only reopen it if the key has changed.
+    // The old surface stays mapped until the new one is, so a failure leaves `shm` usable.
+    int currentKey = reconfigure.shmKeyDefined;
+    int newFD = shmFD;
+    if(currentKey != _shmKey) {
+        FORMAT_SHM(shmName, currentKey);
+        newFD = shm_open(shmName, O_RDWR, 0);
+        if(newFD == -1) {
+            std::cout << "Failed to get reconfigured shm!" << std::endl;
+            return false;
+        }
+    }
+    unsigned char *memory = (unsigned char *) mmap(NULL, reconfigure.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, newFD, 0);
+    if(memory == MAP_FAILED) {
+        std::cout << "Failed to mmap() reconfigured shm!" << std::endl;
+        if(newFD != shmFD) {
+            close(newFD);
+        }
+        return false;
+    }
+    munmap(shm, shmSize);
+    if(newFD != shmFD) {
+        close(shmFD);
+        shmFD = newFD;
+        _shmKey = currentKey;
+    }
+    shm = memory;
+    shmSize = reconfigure.shmSize;
+    _width = reconfigure.width;
+    _height = reconfigure.height;
+    _stride = reconfigure.stride;
+    _format = reconfigure.framebufferType;
+    return true;
+}
+
+unsigned short qtfb::ClientConnection::overlayWidth() const { return _overlayWidth; }
+unsigned short qtfb::ClientConnection::overlayHeight() const { return _overlayHeight; }
+
+void qtfb::ClientConnection::_unmapOverlay() {
+    if(overlay != NULL) {
+        munmap(overlay, overlaySize);
+    }
+    overlay = NULL;
+    overlaySize = 0;
+}
+
+bool qtfb::ClientConnection::_applyOverlay(const struct InitMessageResponseContents &response) {
+    _unmapOverlay();
+    FORMAT_SHM(shmName, response.shmKeyDefined);
+    int overlayFD = shm_open(shmName, O_RDWR, 0);
+    if(overlayFD == -1) {
+        std::cout << "Failed to get overlay shm!" << std::endl;
+        return false;
+    }
+    unsigned char *memory = (unsigned char *) mmap(NULL, response.shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, overlayFD, 0);
+    // The mapping keeps the object alive.
+    close(overlayFD);
+    if(memory == MAP_FAILED) {
+        std::cout << "Failed to mmap() overlay shm!" << std::endl;
+        return false;
+    }
+    overlay = memory;
+    overlaySize = response.shmSize;
+    return true;
+}
+
+bool qtfb::ClientConnection::attachOverlay(uint16_t width, uint16_t height, int timeout) {
+    _unmapOverlay();
+    if(!_send({
+            .type = MESSAGE_OVERLAY,
+            .overlay = {
+                .operation = OVERLAY_ATTACH,
+                .x = 0, .y = 0,
+                .width = width,
+                .height = height,
+            },
+        })) {
+        return false;
+    }
+    _overlayWidth = width;
+    _overlayHeight = height;
+    // Same as waitForFrameCredit() - anything else that arrives meanwhile is kept.
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    for(;;) {
+        if(poll(&pfd, 1, timeout) < 1) {
+            return false;
+        }
+        struct ServerMessage message;
+        if(!_receive(message)) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            return false;
+        }
+        if(message.type == MESSAGE_OVERLAY) {
+            return overlay != NULL;
+        }
+        _pendingMessages.push_back(message);
+    }
+}
+
+bool qtfb::ClientConnection::showOverlay(int x, int y) {
+    return _send({
+            .type = MESSAGE_OVERLAY,
+            .overlay = {
+                .operation = OVERLAY_SHOW,
+                .x = x, .y = y,
+            },
+        });
+}
+
+bool qtfb::ClientConnection::hideOverlay() {
+    return _send({
+            .type = MESSAGE_OVERLAY,
+            .overlay = {
+                .operation = OVERLAY_HIDE,
+            },
+        });
+}
+
+bool qtfb::ClientConnection::detachOverlay() {
+    _unmapOverlay();
+    _overlayWidth = _overlayHeight = 0;
+    return _send({
+            .type = MESSAGE_OVERLAY,
+            .overlay = {
+                .operation = OVERLAY_DETACH,
+            },
+        });
+}
+
+bool qtfb::ClientConnection::setInkEcho(bool enabled, uint32_t argb, uint16_t minWidth, uint16_t maxWidth) {
+    return _send({
+            .type = MESSAGE_INK_ECHO,
+            .inkEcho = {
+                .enabled = enabled,
+                .color = argb,
+                .minWidth = minWidth,
+                .maxWidth = maxWidth,
+            },
+        });
+}
+
+bool qtfb::ClientConnection::_receive(struct ServerMessage &message, int flags) {
+    if(recv(fd, &message, sizeof(message), flags) < 1) {
+        return false;
+    }
+    switch(message.type) {
+        case MESSAGE_RECONFIGURE:
+            return _applyReconfigure(message.reconfigure);
+        case MESSAGE_VISIBILITY:
+            _visibility = message.visibility.state;
+            break;
+        case MESSAGE_FRAME_CREDIT:
+            _frameCredit = true;
+            break;
+        case MESSAGE_OVERLAY:
+            return _applyOverlay(message.init);
+    }
+    return true;
+}
+
 bool qtfb::ClientConnection::pollServerPacket(struct ServerMessage &message) {
-    if(recv(fd, &message, sizeof(message), 0) < 1) {
+    if(!_pendingMessages.empty()) {
+        message = _pendingMessages.front();
+        _pendingMessages.pop_front();
+        return true;
+    }
+    return _receive(message);
+}
+
+bool qtfb::ClientConnection::requestFrameCredits() {
+    if(_frameCreditsRequested) return true;
+    if(!_send({ .type = MESSAGE_REQUEST_FRAME_CREDITS })) {
         return false;
     }
+    _frameCreditsRequested = true;
     return true;
 }
 
+void qtfb::ClientConnection::_useFrameCredit() {
+    if(_frameCreditsRequested) {
+        _frameCredit = false;
+    }
+}
+
+bool qtfb::ClientConnection::canRender() const {
+    return _frameCredit;
+}
+
+bool qtfb::ClientConnection::waitForFrameCredit(int timeout) {
+    if(!requestFrameCredits()) {
+        return false;
+    }
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while(!_frameCredit) {
+        if(poll(&pfd, 1, timeout) < 1) {
+            return false;
+        }
+        struct ServerMessage message;
+        if(!_receive(message)) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            return false;
+        }
+        _pendingMessages.push_back(message);
+    }
+    return true;
+}
+
+void qtfb::ClientConnection::_dispatchMessage(const struct ServerMessage &message) {
+    switch(message.type) {
+        case MESSAGE_USERINPUT: {
+            if(onUserInput) onUserInput(message.userInput);
+            // Waiters may queue themselves up again while being resumed.
+            std::vector<std::function<void(const struct UserInputContents &)>> waiters;
+            waiters.swap(_inputWaiters);
+            for(auto &waiter : waiters) waiter(message.userInput);
+            break;
+        }
+        case MESSAGE_FRAME_CREDIT: {
+            if(onFramePresented) onFramePresented();
+            std::vector<std::function<void()>> waiters;
+            waiters.swap(_presentWaiters);
+            for(auto &waiter : waiters) waiter();
+            break;
+        }
+        case MESSAGE_VISIBILITY:
+            if(onVisibilityChanged) onVisibilityChanged(message.visibility.state);
+            break;
+        case MESSAGE_RECONFIGURE:
+            if(onReconfigured) onReconfigured();
+            break;
+    }
+}
+
+int qtfb::ClientConnection::dispatch() {
+    int handled = 0;
+    if(onFramePresented && !requestFrameCredits()) {
+        return -1;
+    }
+    while(!_pendingMessages.empty()) {
+        struct ServerMessage message = _pendingMessages.front();
+        _pendingMessages.pop_front();
+        _dispatchMessage(message);
+        handled++;
+    }
+    for(;;) {
+        struct ServerMessage message;
+        errno = 0;
+        if(!_receive(message, MSG_DONTWAIT)) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if(errno == EINTR) continue;
+            // The server hung up (or the surface couldn't be remapped).
+            return -1;
+        }
+        _dispatchMessage(message);
+        handled++;
+    }
+    return handled;
+}
+
+void qtfb::ClientConnection::whenNextInput(std::function<void(const struct UserInputContents &)> callback) {
+    _inputWaiters.push_back(std::move(callback));
+}
+
+void qtfb::ClientConnection::whenFramePresented(std::function<void()> callback) {
+    requestFrameCredits();
+    if(_frameCredit) {
+        callback();
+        return;
+    }
+    _presentWaiters.push_back(std::move(callback));
+}
 
 qtfb::FBKey qtfb::getIDFromAppload() {
     const char *key = getenv("QTFB_KEY");
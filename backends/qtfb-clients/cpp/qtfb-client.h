@@ -9,26 +9,180 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <optional>
 #include <tuple>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define QTFB_CLIENT_COROUTINES
+#endif
+
+// Connection errors, returned by ClientConnection::create(). The blocking constructor exit()s
+// with them.
+#define QTFB_OK 0
+#define QTFB_ERROR_SOCKET -1
+#define QTFB_ERROR_CONNECT -2
+#define QTFB_ERROR_SEND_INIT -3
+#define QTFB_ERROR_RECV_INIT -4
+#define QTFB_ERROR_SHM_OPEN -5
+#define QTFB_ERROR_SHM_MAP -6
+#define QTFB_ERROR_SOCKET_STATUS -7
+#define QTFB_ERROR_SOCKET_NONBLOCK -8
+#define QTFB_ERROR_SEND_IMPORT -9
+#define QTFB_ERROR_IMPORT_REJECTED -10
 
 namespace qtfb{
     class ClientConnection {
     public:
         ClientConnection(FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution = {}, bool nonBlocking = true);
+        // Same as the constructor, but returns NULL (and the QTFB_ERROR_* code through error)
+        // instead of exiting the process if the connection can't be established.
+        static ClientConnection *create(FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution = {}, bool nonBlocking = true, int *error = NULL);
+
+        // A buffer owned by the client, which the server shows without copying. fd has to be
+        // a memfd sealed against shrinking - createBuffer() makes one.
+        struct Buffer {
+            int fd;
+            uint32_t stride;
+            uint32_t offset;
+        };
+        // Connects with the client's own buffers (up to QTFB_MAX_IMPORTED_BUFFERS) instead of
+        // a server-allocated surface - shm stays NULL. Draw into one buffer while another is
+        // presented, and only draw into the presented one again after the next frame credit.
+        // The fds stay owned by the caller.
+        static ClientConnection *importBuffers(FBKey framebufferID, uint8_t shmType, uint16_t width, uint16_t height, const std::vector<Buffer> &buffers, bool nonBlocking = true, int *error = NULL);
+        // A memfd of that size, which the server accepts for import. -1 on failure.
+        static int createBuffer(size_t size);
+        // Shows the imported buffer in `slot`, and updates all / part of it.
+        bool presentBuffer(int slot);
+        bool presentBuffer(int slot, int x, int y, int w, int h);
         ~ClientConnection();
-        void sendCompleteUpdate();
-        void sendPartialUpdate(int x, int y, int w, int h);
-        unsigned char *shm;
-        int shmFD;
-        size_t shmSize;
+        // These return false if the message couldn't be sent (the server is gone).
+        bool sendCompleteUpdate();
+        bool sendPartialUpdate(int x, int y, int w, int h);
+        // Asks the server to change the surface in-place. Width / height of 0 mean the format's
+        // default resolution. The new surface is mapped once pollServerPacket() receives the
+        // MESSAGE_RECONFIGURE reply - shm, width() and height() are only valid after that.
+        bool requestReconfigure(uint8_t shmType, uint16_t width = 0, uint16_t height = 0);
+        unsigned char *shm = NULL;
+        int shmFD = -1;
+        size_t shmSize = 0;
         bool pollServerPacket(struct ServerMessage &message);
+        // The socket to the server, for poll()ing on it.
+        int socketFD() const;
+        // Frame pacing. Sending an update uses up the frame credit, the server grants a new one
+        // once that frame has been painted. Rendering only when canRender() keeps the client from
+        // getting ahead of the compositor.
+        // Credits are opt-in: the server only sends them once requestFrameCredits() has been
+        // called, and only clients that keep reading their socket may call it. Until then,
+        // canRender() is always true. waitForFrameCredit(), whenFramePresented() and dispatch()
+        // with onFramePresented set request them automatically.
+        bool requestFrameCredits();
+        bool canRender() const;
+        // Blocks until the server grants a frame credit (or the timeout, in ms, expires).
+        // Everything received in the meantime - the credit included - is kept for
+        // pollServerPacket() and dispatch(), so onFramePresented and whenFramePresented() still fire.
+        // Must not be used while another thread is calling pollServerPacket().
+        bool waitForFrameCredit(int timeout = -1);
+        // A small RGBA8888 surface composited on top of the main one, for cursors and ink that's
+        // still being drawn. Showing or moving it only repaints its old and new rects - the main
+        // surface is left alone. Blocks (up to timeout ms) until the server has allocated it.
+        bool attachOverlay(uint16_t width, uint16_t height, int timeout = -1);
+        // Shows the overlay with its top left corner at x, y. Also call it after drawing into it.
+        bool showOverlay(int x, int y);
+        bool hideOverlay();
+        bool detachOverlay();
+        unsigned char *overlay = NULL;
+        size_t overlaySize = 0;
+        unsigned short overlayWidth() const; unsigned short overlayHeight() const;
+
+        // Has the compositor draw pen strokes right away, in this color (0xAARRGGBB) and
+        // width range (by pressure), until the client's own update covers them.
+        bool setInkEcho(bool enabled, uint32_t argb = 0xFF000000, uint16_t minWidth = 1, uint16_t maxWidth = 4);
+
         unsigned short width() const; unsigned short height() const;
+        unsigned int stride() const;
+        uint8_t format() const;
+        // Last VISIBILITY_* state received from the server. Clients should stop rendering
+        // while it's not VISIBILITY_VISIBLE.
+        int visibility() const;
+
+        // Event loop integration: wait for socketFD() to become readable in your own loop
+        // (epoll, QSocketNotifier, libuv...), then call dispatch(). It handles every message
+        // that's already there without blocking, and calls the callbacks below.
+        // Returns the number of messages handled, or -1 once the connection is gone.
+        int dispatch();
+        std::function<void(const struct UserInputContents &)> onUserInput;
+        // The last frame sent has been presented - a new one may be rendered.
+        std::function<void()> onFramePresented;
+        std::function<void(int)> onVisibilityChanged;
+        // The surface has been remapped - shm, width() and height() have changed.
+        std::function<void()> onReconfigured;
+
+        // One-shot versions of the above, called from dispatch().
+        void whenNextInput(std::function<void(const struct UserInputContents &)> callback);
+        // Called right away if no frame is in flight.
+        void whenFramePresented(std::function<void()> callback);
+
+#ifdef QTFB_CLIENT_COROUTINES
+        // C++20 awaitables, resumed from dispatch():
+        //   UserInputContents input = co_await connection->nextInput();
+        //   co_await connection->framePresented();
+        struct InputAwaitable {
+            ClientConnection *connection;
+            struct UserInputContents result;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) {
+                connection->whenNextInput([this, handle](const struct UserInputContents &input) {
+                    result = input;
+                    handle.resume();
+                });
+            }
+            struct UserInputContents await_resume() const noexcept { return result; }
+        };
+        struct FramePresentedAwaitable {
+            ClientConnection *connection;
+            bool await_ready() const noexcept { return connection->canRender(); }
+            void await_suspend(std::coroutine_handle<> handle) {
+                connection->whenFramePresented([handle]() { handle.resume(); });
+            }
+            void await_resume() const noexcept {}
+        };
+        InputAwaitable nextInput() { return { this, {} }; }
+        FramePresentedAwaitable framePresented() { return { this }; }
+#endif
     private:
-        int fd;
+        ClientConnection() = default;
+        int _connect(FBKey framebufferID, uint8_t shmType, std::optional<std::tuple<uint16_t, uint16_t>> customResolution, bool nonBlocking);
+        int _import(FBKey framebufferID, uint8_t shmType, uint16_t width, uint16_t height, const std::vector<Buffer> &buffers, bool nonBlocking);
+        static int _openSocket(int &sock);
+        static int _setNonBlocking(int sock);
+        int fd = -1;
         unsigned short _width, _height;
-        void _send(const struct ClientMessage &message);
+        unsigned int _stride;
+        uint8_t _format;
+        int _shmKey;
+        int _visibility = VISIBILITY_VISIBLE;
+        unsigned short _overlayWidth = 0, _overlayHeight = 0;
+        std::atomic<bool> _frameCredit = true;
+        bool _frameCreditsRequested = false;
+        // After sending an update - only without a credit if the server is going to send one.
+        void _useFrameCredit();
+        std::deque<struct ServerMessage> _pendingMessages;
+        std::vector<std::function<void(const struct UserInputContents &)>> _inputWaiters;
+        std::vector<std::function<void()>> _presentWaiters;
+        bool _receive(struct ServerMessage &message, int flags = 0);
+        bool _send(const struct ClientMessage &message);
+        void _dispatchMessage(const struct ServerMessage &message);
+        bool _applyReconfigure(const struct ReconfigureMessageResponseContents &reconfigure);
+        bool _applyOverlay(const struct InitMessageResponseContents &overlay);
+        void _unmapOverlay();
     };
 
     FBKey getIDFromAppload();
+    unsigned int bytesPerPixel(uint8_t shmType);
 }
@@ -0,0 +1,124 @@
+#include "qtfb-damage.h"
+#include <algorithm>
+
+qtfb::DamageRect qtfb::DamageRect::united(const DamageRect &other) const {
+    int left = std::min(x, other.x), top = std::min(y, other.y);
+    int right = std::max(x + w, other.x + other.w), bottom = std::max(y + h, other.y + other.h);
+    return { left, top, right - left, bottom - top };
+}
+
+bool qtfb::DamageRect::intersects(const DamageRect &other) const {
+    return x < other.x + other.w && other.x < x + w && y < other.y + other.h && other.y < y + h;
+}
+
+// Area covered by both rects together - only exact if they don't overlap, which is fine
+// for deciding what to merge.
+static long coveredArea(const qtfb::DamageRect &a, const qtfb::DamageRect &b) {
+    if(!a.intersects(b)) return a.area() + b.area();
+    int overlapW = std::min(a.x + a.w, b.x + b.w) - std::max(a.x, b.x);
+    int overlapH = std::min(a.y + a.h, b.y + b.h) - std::max(a.y, b.y);
+    return a.area() + b.area() - (long) overlapW * overlapH;
+}
+
+qtfb::DamageRegion::DamageRegion(int width, int height, int tileSize)
+    : _width(width), _height(height), _tileSize(std::max(1, tileSize)) {}
+
+void qtfb::DamageRegion::add(int x, int y, int w, int h) {
+    if(_complete) return;
+
+    // Clip, then align outwards to the tile grid.
+    int left = std::max(0, x), top = std::max(0, y);
+    int right = std::min(_width, x + w), bottom = std::min(_height, y + h);
+    if(left >= right || top >= bottom) return;
+    left -= left % _tileSize;
+    top -= top % _tileSize;
+    right = std::min(_width, (right + _tileSize - 1) / _tileSize * _tileSize);
+    bottom = std::min(_height, (bottom + _tileSize - 1) / _tileSize * _tileSize);
+    DamageRect rect = { left, top, right - left, bottom - top };
+
+    // Merging can make the result worth merging with another rect - repeat until stable.
+    bool merged = true;
+    while(merged) {
+        merged = false;
+        for(auto it = _rects.begin(); it != _rects.end(); it++) {
+            DamageRect united = rect.united(*it);
+            if(united.area() <= coveredArea(rect, *it) * (1.0 + mergeOverhead)) {
+                rect = united;
+                _rects.erase(it);
+                merged = true;
+                break;
+            }
+        }
+    }
+    _rects.push_back(rect);
+
+    while(_rects.size() > maxRects) {
+        _mergeCheapest();
+    }
+    if(dirtyFraction() >= completeUpdateThreshold) {
+        addAll();
+    }
+}
+
+void qtfb::DamageRegion::_mergeCheapest() {
+    size_t bestA = 0, bestB = 1;
+    long bestCost = -1;
+    for(size_t a = 0; a < _rects.size(); a++) {
+        for(size_t b = a + 1; b < _rects.size(); b++) {
+            long cost = _rects[a].united(_rects[b]).area() - coveredArea(_rects[a], _rects[b]);
+            if(bestCost == -1 || cost < bestCost) {
+                bestCost = cost;
+                bestA = a;
+                bestB = b;
+            }
+        }
+    }
+    _rects[bestA] = _rects[bestA].united(_rects[bestB]);
+    _rects.erase(_rects.begin() + bestB);
+}
+
+void qtfb::DamageRegion::addAll() {
+    _complete = true;
+    _rects.assign(1, { 0, 0, _width, _height });
+}
+
+void qtfb::DamageRegion::clear() {
+    _complete = false;
+    _rects.clear();
+}
+
+void qtfb::DamageRegion::resize(int width, int height) {
+    _width = width;
+    _height = height;
+    clear();
+}
+
+bool qtfb::DamageRegion::empty() const {
+    return _rects.empty();
+}
+
+const std::vector<qtfb::DamageRect> &qtfb::DamageRegion::rects() const {
+    return _rects;
+}
+
+double qtfb::DamageRegion::dirtyFraction() const {
+    if(_complete) return 1.0;
+    long total = (long) _width * _height;
+    if(total == 0) return 0.0;
+    long dirty = 0;
+    for(const DamageRect &rect : _rects) dirty += rect.area();
+    return std::min(1.0, (double) dirty / total);
+}
+
+bool qtfb::DamageRegion::flush(ClientConnection &connection) {
+    bool status = true;
+    if(_complete) {
+        status = connection.sendCompleteUpdate();
+    } else {
+        for(const DamageRect &rect : _rects) {
+            status &= connection.sendPartialUpdate(rect.x, rect.y, rect.w, rect.h);
+        }
+    }
+    clear();
+    return status;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "qtfb-client.h"
+#include <vector>
+
+namespace qtfb {
+    struct DamageRect {
+        int x, y, w, h;
+
+        long area() const { return (long) w * h; }
+        DamageRect united(const DamageRect &other) const;
+        bool intersects(const DamageRect &other) const;
+    };
+
+    // Collects what a client has drawn during a frame, and sends it once per frame in
+    // whichever form is cheapest for the server: a few partial updates, or a complete
+    // update once enough of the surface is dirty.
+    //
+    //   region.add(x, y, w, h); // as often as needed while drawing
+    //   region.flush(connection); // once the frame is done
+    class DamageRegion {
+    public:
+        DamageRegion(int width, int height, int tileSize = 32);
+
+        // Rects are clipped to the surface and grown to tile boundaries.
+        void add(int x, int y, int w, int h);
+        void add(const DamageRect &rect) { add(rect.x, rect.y, rect.w, rect.h); }
+        void addAll();
+        void clear();
+        // After a reconfigure - drops all the damage collected so far.
+        void resize(int width, int height);
+
+        bool empty() const;
+        const std::vector<DamageRect> &rects() const;
+        // Fraction of the surface which will be sent (0 - 1).
+        double dirtyFraction() const;
+
+        // Sends the damage and clears it. Returns false if sending failed.
+        bool flush(ClientConnection &connection);
+
+        // Above this dirty fraction, a complete update is sent instead of partial ones.
+        double completeUpdateThreshold = 0.5;
+        // Two rects are merged if their bounding box is at most this much larger than the
+        // area they cover.
+        double mergeOverhead = 0.25;
+        // Upper bound on the number of partial updates per frame.
+        size_t maxRects = 8;
+
+    private:
+        int _width, _height, _tileSize;
+        bool _complete = false;
+        std::vector<DamageRect> _rects;
+
+        void _mergeCheapest();
+    };
+}
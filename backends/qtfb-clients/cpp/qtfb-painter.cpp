@@ -0,0 +1,255 @@
+#include "qtfb-painter.h"
+#include "qtfb-pixels.h"
+#include <algorithm>
+#include <cmath>
+#include <string.h>
+
+#define KIND_RGB565 0
+#define KIND_RGB888 1
+#define KIND_RGBA8888 2
+
+static int getKind(uint8_t format) {
+    if(qtfb::isRGB565(format)) return KIND_RGB565;
+    return qtfb::bytesPerPixel(format) == 3 ? KIND_RGB888 : KIND_RGBA8888;
+}
+
+// a * b / 255, rounded
+static inline unsigned multiply255(unsigned a, unsigned b) {
+    unsigned value = a * b + 128;
+    return (value + (value >> 8)) >> 8;
+}
+
+// Decodes one UTF-8 sequence and advances text past it. Invalid bytes decode as U+FFFD.
+static uint32_t nextCodepoint(const char *&text) {
+    const uint8_t *bytes = (const uint8_t *) text;
+    uint32_t codepoint;
+    int length;
+    if(bytes[0] < 0x80) { codepoint = bytes[0]; length = 1; }
+    else if((bytes[0] & 0xE0) == 0xC0) { codepoint = bytes[0] & 0x1F; length = 2; }
+    else if((bytes[0] & 0xF0) == 0xE0) { codepoint = bytes[0] & 0x0F; length = 3; }
+    else if((bytes[0] & 0xF8) == 0xF0) { codepoint = bytes[0] & 0x07; length = 4; }
+    else { text++; return 0xFFFD; }
+    for(int i = 1; i < length; i++) {
+        if((bytes[i] & 0xC0) != 0x80) {
+            text += i;
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (bytes[i] & 0x3F);
+    }
+    text += length;
+    return codepoint;
+}
+
+qtfb::GlyphCache::GlyphCache(const uint8_t *atlas, int atlasWidth, int atlasHeight, size_t atlasStride, int lineHeight)
+    : _atlas(atlas), _atlasWidth(atlasWidth), _atlasHeight(atlasHeight), _atlasStride(atlasStride), _lineHeight(lineHeight) {}
+
+void qtfb::GlyphCache::addGlyph(uint32_t codepoint, const Glyph &glyph) {
+    Glyph clipped = glyph;
+    // Never read outside of the atlas.
+    clipped.width = std::max(0, std::min(glyph.width, _atlasWidth - glyph.atlasX));
+    clipped.height = std::max(0, std::min(glyph.height, _atlasHeight - glyph.atlasY));
+    if(codepoint < 128) {
+        _ascii[codepoint] = clipped;
+        _hasAscii[codepoint] = true;
+    } else {
+        _glyphs[codepoint] = clipped;
+    }
+}
+
+const qtfb::Glyph *qtfb::GlyphCache::find(uint32_t codepoint) const {
+    if(codepoint < 128) {
+        return _hasAscii[codepoint] ? &_ascii[codepoint] : NULL;
+    }
+    auto position = _glyphs.find(codepoint);
+    return position == _glyphs.end() ? NULL : &position->second;
+}
+
+int qtfb::GlyphCache::measure(const char *text) const {
+    int width = 0;
+    while(*text) {
+        const Glyph *glyph = find(nextCodepoint(text));
+        if(glyph) width += glyph->advance;
+    }
+    return width;
+}
+
+qtfb::Painter::Painter(ClientConnection &connection, DamageRegion *damage)
+    : Painter(connection.shm, connection.width(), connection.height(), connection.stride(), connection.format(), damage) {}
+
+qtfb::Painter::Painter(uint8_t *pixels, int width, int height, size_t stride, uint8_t format, DamageRegion *damage)
+    : _pixels(pixels), _width(width), _height(height), _stride(stride), _format(format),
+      _kind(getKind(format)), _clip({ 0, 0, width, height }), _damage(damage) {}
+
+void qtfb::Painter::setClip(int x, int y, int w, int h) {
+    int left = std::max(0, x), top = std::max(0, y);
+    int right = std::min(_width, x + w), bottom = std::min(_height, y + h);
+    _clip = { left, top, std::max(0, right - left), std::max(0, bottom - top) };
+}
+
+void qtfb::Painter::resetClip() {
+    _clip = { 0, 0, _width, _height };
+}
+
+bool qtfb::Painter::_clipRect(DamageRect &rect) const {
+    int left = std::max(rect.x, _clip.x), top = std::max(rect.y, _clip.y);
+    int right = std::min(rect.x + rect.w, _clip.x + _clip.w);
+    int bottom = std::min(rect.y + rect.h, _clip.y + _clip.h);
+    if(left >= right || top >= bottom) return false;
+    rect = { left, top, right - left, bottom - top };
+    return true;
+}
+
+void qtfb::Painter::_damaged(const DamageRect &rect) {
+    if(_damage) _damage->add(rect);
+}
+
+inline uint8_t *qtfb::Painter::_pixel(int x, int y) const {
+    static const int sizes[] = { 2, 3, 4 };
+    return _pixels + y * _stride + x * sizes[_kind];
+}
+
+inline void qtfb::Painter::_blend(uint8_t *pixel, uint8_t r, uint8_t g, uint8_t b, unsigned alpha) const {
+    if(alpha == 0) return;
+    unsigned inverse = 255 - alpha;
+    if(_kind == KIND_RGB565) {
+        uint16_t value = *(uint16_t *) pixel;
+        unsigned dr = (value >> 11) << 3, dg = ((value >> 5) & 0x3F) << 2, db = (value & 0x1F) << 3;
+        dr = multiply255(r, alpha) + multiply255(dr | (dr >> 5), inverse);
+        dg = multiply255(g, alpha) + multiply255(dg | (dg >> 6), inverse);
+        db = multiply255(b, alpha) + multiply255(db | (db >> 5), inverse);
+        *(uint16_t *) pixel = ((dr >> 3) << 11) | ((dg >> 2) << 5) | (db >> 3);
+    } else {
+        pixel[0] = multiply255(r, alpha) + multiply255(pixel[0], inverse);
+        pixel[1] = multiply255(g, alpha) + multiply255(pixel[1], inverse);
+        pixel[2] = multiply255(b, alpha) + multiply255(pixel[2], inverse);
+        if(_kind == KIND_RGBA8888) pixel[3] = alpha + multiply255(pixel[3], inverse);
+    }
+}
+
+void qtfb::Painter::fillRect(int x, int y, int w, int h, uint32_t argb) {
+    DamageRect rect = { x, y, w, h };
+    if(!_clipRect(rect)) return;
+    unsigned alpha = argb >> 24;
+    if(alpha == 0) return;
+    if(alpha == 255) {
+        fillPixels(_pixel(rect.x, rect.y), _stride, _format, rect.w, rect.h, argb);
+    } else {
+        uint8_t r = argb >> 16, g = argb >> 8, b = argb;
+        for(int row = rect.y; row < rect.y + rect.h; row++) {
+            for(int column = rect.x; column < rect.x + rect.w; column++) {
+                _blend(_pixel(column, row), r, g, b, alpha);
+            }
+        }
+    }
+    _damaged(rect);
+}
+
+void qtfb::Painter::drawLine(int x0, int y0, int x1, int y1, uint32_t argb) {
+    // Axis-aligned lines are rects.
+    if(x0 == x1 || y0 == y1) {
+        fillRect(std::min(x0, x1), std::min(y0, y1), std::abs(x1 - x0) + 1, std::abs(y1 - y0) + 1, argb);
+        return;
+    }
+    uint8_t r = argb >> 16, g = argb >> 8, b = argb;
+    unsigned alpha = argb >> 24;
+    int dx = std::abs(x1 - x0), dy = -std::abs(y1 - y0);
+    int stepX = x0 < x1 ? 1 : -1, stepY = y0 < y1 ? 1 : -1;
+    int error = dx + dy;
+    DamageRect bounds = { std::min(x0, x1), std::min(y0, y1), dx + 1, -dy + 1 };
+    if(!_clipRect(bounds)) return;
+    for(;;) {
+        if(x0 >= bounds.x && x0 < bounds.x + bounds.w && y0 >= bounds.y && y0 < bounds.y + bounds.h) {
+            _blend(_pixel(x0, y0), r, g, b, alpha);
+        }
+        if(x0 == x1 && y0 == y1) break;
+        int doubled = 2 * error;
+        if(doubled >= dy) { error += dy; x0 += stepX; }
+        if(doubled <= dx) { error += dx; y0 += stepY; }
+    }
+    _damaged(bounds);
+}
+
+void qtfb::Painter::strokeLine(float x0, float y0, float x1, float y1, float width, uint32_t argb) {
+    float radius = width / 2;
+    DamageRect bounds = {
+        (int) std::floor(std::min(x0, x1) - radius - 1),
+        (int) std::floor(std::min(y0, y1) - radius - 1),
+        0, 0,
+    };
+    bounds.w = (int) std::ceil(std::max(x0, x1) + radius + 1) - bounds.x + 1;
+    bounds.h = (int) std::ceil(std::max(y0, y1) + radius + 1) - bounds.y + 1;
+    if(!_clipRect(bounds)) return;
+
+    uint8_t r = argb >> 16, g = argb >> 8, b = argb;
+    unsigned alpha = argb >> 24;
+    float dx = x1 - x0, dy = y1 - y0;
+    float lengthSquared = dx * dx + dy * dy;
+    for(int row = bounds.y; row < bounds.y + bounds.h; row++) {
+        for(int column = bounds.x; column < bounds.x + bounds.w; column++) {
+            // Distance from the pixel's center to the segment
+            float px = column + 0.5f - x0, py = row + 0.5f - y0;
+            float t = lengthSquared > 0 ? std::clamp((px * dx + py * dy) / lengthSquared, 0.0f, 1.0f) : 0.0f;
+            float ex = px - t * dx, ey = py - t * dy;
+            float coverage = radius + 0.5f - std::sqrt(ex * ex + ey * ey);
+            if(coverage <= 0) continue;
+            if(coverage > 1) coverage = 1;
+            _blend(_pixel(column, row), r, g, b, (unsigned) (alpha * coverage + 0.5f));
+        }
+    }
+    _damaged(bounds);
+}
+
+void qtfb::Painter::blitRGBA(const uint8_t *image, size_t imageStride, int imageWidth, int imageHeight, int x, int y) {
+    DamageRect rect = { x, y, imageWidth, imageHeight };
+    if(!_clipRect(rect)) return;
+    for(int row = 0; row < rect.h; row++) {
+        const uint8_t *source = image + (rect.y - y + row) * imageStride + (rect.x - x) * 4;
+        int column = 0;
+        while(column < rect.w) {
+            // Runs of opaque pixels go through the vectorized converter.
+            int run = 0;
+            while(column + run < rect.w && source[(column + run) * 4 + 3] == 255) run++;
+            if(run) {
+                convertFromRGBA8888(source + column * 4, imageStride, _pixel(rect.x + column, rect.y + row), _stride, _format, run, 1);
+                column += run;
+                continue;
+            }
+            const uint8_t *pixel = source + column * 4;
+            _blend(_pixel(rect.x + column, rect.y + row), pixel[0], pixel[1], pixel[2], pixel[3]);
+            column++;
+        }
+    }
+    _damaged(rect);
+}
+
+void qtfb::Painter::copy(const uint8_t *pixels, size_t pixelStride, int pixelWidth, int pixelHeight, int x, int y) {
+    DamageRect rect = { x, y, pixelWidth, pixelHeight };
+    if(!_clipRect(rect)) return;
+    const uint8_t *source = pixels + (rect.y - y) * pixelStride + (rect.x - x) * bytesPerPixel(_format);
+    copyPixels(source, pixelStride, _pixel(rect.x, rect.y), _stride, _format, rect.w, rect.h);
+    _damaged(rect);
+}
+
+int qtfb::Painter::drawText(const GlyphCache &glyphs, int x, int y, const char *text, uint32_t argb) {
+    uint8_t r = argb >> 16, g = argb >> 8, b = argb;
+    unsigned alpha = argb >> 24;
+    DamageRect touched = { 0, 0, 0, 0 };
+    while(*text) {
+        const Glyph *glyph = glyphs.find(nextCodepoint(text));
+        if(!glyph) continue;
+        DamageRect rect = { x + glyph->bearingX, y - glyph->bearingY, glyph->width, glyph->height };
+        DamageRect visible = rect;
+        if(_clipRect(visible)) {
+            touched = touched.area() ? touched.united(visible) : visible;
+            for(int row = visible.y; row < visible.y + visible.h; row++) {
+                const uint8_t *coverage = glyphs.atlas() + (glyph->atlasY + row - rect.y) * glyphs.atlasStride() + glyph->atlasX - rect.x;
+                for(int column = visible.x; column < visible.x + visible.w; column++) {
+                    _blend(_pixel(column, row), r, g, b, multiply255(coverage[column], alpha));
+                }
+            }
+        }
+        x += glyph->advance;
+    }
+    if(touched.area()) _damaged(touched);
+    return x;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include "qtfb-client.h"
+#include "qtfb-damage.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_map>
+
+// A small software rasterizer drawing straight into a qtfb surface, in its native format.
+// Every operation is clipped, and records what it touched in the DamageRegion, if one is given.
+//
+// Colors are 0xAARRGGBB, RGBA images have red in the first byte (as decoders produce them),
+// with straight (not premultiplied) alpha.
+namespace qtfb {
+    struct Glyph {
+        // Position of the glyph's coverage in the atlas
+        int atlasX, atlasY, width, height;
+        // Offset of the bitmap's top left corner from the pen position on the baseline
+        int bearingX, bearingY;
+        int advance;
+    };
+
+    // Text rendered from a pre-rasterized atlas: an 8-bit coverage image holding every glyph,
+    // and the metrics telling where each one is. The atlas memory has to outlive the cache.
+    class GlyphCache {
+    public:
+        GlyphCache(const uint8_t *atlas, int atlasWidth, int atlasHeight, size_t atlasStride, int lineHeight);
+        void addGlyph(uint32_t codepoint, const Glyph &glyph);
+        // NULL if the atlas has no such glyph
+        const Glyph *find(uint32_t codepoint) const;
+        // Width of the UTF-8 text, in pixels
+        int measure(const char *text) const;
+
+        const uint8_t *atlas() const { return _atlas; }
+        size_t atlasStride() const { return _atlasStride; }
+        int lineHeight() const { return _lineHeight; }
+
+    private:
+        const uint8_t *_atlas;
+        int _atlasWidth, _atlasHeight;
+        size_t _atlasStride;
+        int _lineHeight;
+        // ASCII is looked up directly, everything else through the map.
+        Glyph _ascii[128];
+        bool _hasAscii[128] = { false };
+        std::unordered_map<uint32_t, Glyph> _glyphs;
+    };
+
+    class Painter {
+    public:
+        // Paints on the connection's current surface. Create a new painter after a reconfigure.
+        Painter(ClientConnection &connection, DamageRegion *damage = NULL);
+        Painter(uint8_t *pixels, int width, int height, size_t stride, uint8_t format, DamageRegion *damage = NULL);
+
+        void setClip(int x, int y, int w, int h);
+        void resetClip();
+
+        void fillRect(int x, int y, int w, int h, uint32_t argb);
+        // One pixel wide, aliased
+        void drawLine(int x0, int y0, int x1, int y1, uint32_t argb);
+        // Anti-aliased, with round caps
+        void strokeLine(float x0, float y0, float x1, float y1, float width, uint32_t argb);
+        // Alpha-blends an RGBA8888 image
+        void blitRGBA(const uint8_t *image, size_t imageStride, int imageWidth, int imageHeight, int x, int y);
+        // Copies pixels which already are in the surface's format
+        void copy(const uint8_t *pixels, size_t pixelStride, int pixelWidth, int pixelHeight, int x, int y);
+        // Draws UTF-8 text with its baseline at y. Returns the x after the last glyph.
+        int drawText(const GlyphCache &glyphs, int x, int y, const char *text, uint32_t argb);
+
+    private:
+        uint8_t *_pixels;
+        int _width, _height;
+        size_t _stride;
+        uint8_t _format;
+        int _kind;
+        DamageRect _clip;
+        DamageRegion *_damage;
+
+        // Clips the rect, returns false if nothing is left of it.
+        bool _clipRect(DamageRect &rect) const;
+        void _damaged(const DamageRect &rect);
+        inline uint8_t *_pixel(int x, int y) const;
+        inline void _blend(uint8_t *pixel, uint8_t r, uint8_t g, uint8_t b, unsigned alpha) const;
+    };
+}
@@ -0,0 +1,205 @@
+#include "qtfb-pixels.h"
+#include "qtfb-client.h"
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define QTFB_PIXELS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define QTFB_PIXELS_SSE2
+#endif
+
+// 4x4 ordered dithering matrix
+static const uint8_t bayer4[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 },
+};
+
+bool qtfb::isRGB565(uint8_t format) {
+    return format == FBFMT_RM2FB || format == FBFMT_RMPP_RGB565 || format == FBFMT_RMPPM_RGB565;
+}
+
+static inline uint16_t toRGB565(uint8_t r, uint8_t g, uint8_t b) {
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+static inline uint8_t addSaturated(uint8_t a, uint8_t b) {
+    int sum = a + b;
+    return sum > 255 ? 255 : sum;
+}
+
+uint32_t qtfb::packColor(uint8_t format, uint32_t argb) {
+    uint8_t a = argb >> 24, r = argb >> 16, g = argb >> 8, b = argb;
+    if(isRGB565(format)) return toRGB565(r, g, b);
+    // RGB888 uses the first three bytes of the same layout.
+    return r | (g << 8) | (b << 16) | ((uint32_t) a << 24);
+}
+
+// Scalar conversion of one row, from pixel `x` on. Also finishes the rows the SIMD paths
+// leave a tail of.
+static void convertRowScalar(const uint8_t *source, uint8_t *destination, uint8_t format,
+                             int x, int width, int y, bool dither) {
+    if(qtfb::isRGB565(format)) {
+        uint16_t *out = (uint16_t *) destination;
+        for(; x < width; x++) {
+            const uint8_t *pixel = source + x * 4;
+            if(dither) {
+                uint8_t threshold = bayer4[y & 3][x & 3];
+                out[x] = toRGB565(addSaturated(pixel[0], threshold >> 1),
+                                  addSaturated(pixel[1], threshold >> 2),
+                                  addSaturated(pixel[2], threshold >> 1));
+            } else {
+                out[x] = toRGB565(pixel[0], pixel[1], pixel[2]);
+            }
+        }
+    } else if(qtfb::bytesPerPixel(format) == 3) {
+        for(; x < width; x++) {
+            memcpy(destination + x * 3, source + x * 4, 3);
+        }
+    } else {
+        memcpy(destination + x * 4, source + x * 4, (width - x) * 4);
+    }
+}
+
+#ifdef QTFB_PIXELS_NEON
+// Per-channel dithering offsets for 16 consecutive pixels of row y.
+static void ditherOffsets(int y, uint8x16_t &red, uint8x16_t &green) {
+    uint8_t r[16], g[16];
+    for(int i = 0; i < 16; i++) {
+        r[i] = bayer4[y & 3][i & 3] >> 1;
+        g[i] = bayer4[y & 3][i & 3] >> 2;
+    }
+    red = vld1q_u8(r);
+    green = vld1q_u8(g);
+}
+
+static int convertRowSIMD(const uint8_t *source, uint8_t *destination, uint8_t format, int width, int y, bool dither) {
+    int x = 0;
+    if(qtfb::isRGB565(format)) {
+        uint8x16_t ditherRB = vdupq_n_u8(0), ditherG = vdupq_n_u8(0);
+        if(dither) ditherOffsets(y, ditherRB, ditherG);
+        for(; x + 16 <= width; x += 16) {
+            uint8x16x4_t pixel = vld4q_u8(source + x * 4);
+            uint8x16_t r = vqaddq_u8(pixel.val[0], ditherRB);
+            uint8x16_t g = vqaddq_u8(pixel.val[1], ditherG);
+            uint8x16_t b = vqaddq_u8(pixel.val[2], ditherRB);
+            // RRRRRGGG GGGBBBBB, built from the top bits of each channel
+            uint16x8_t low = vshll_n_u8(vget_low_u8(r), 8);
+            low = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(g), 8), 5);
+            low = vsriq_n_u16(low, vshll_n_u8(vget_low_u8(b), 8), 11);
+            uint16x8_t high = vshll_n_u8(vget_high_u8(r), 8);
+            high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(g), 8), 5);
+            high = vsriq_n_u16(high, vshll_n_u8(vget_high_u8(b), 8), 11);
+            vst1q_u16((uint16_t *) destination + x, low);
+            vst1q_u16((uint16_t *) destination + x + 8, high);
+        }
+    } else if(qtfb::bytesPerPixel(format) == 3) {
+        for(; x + 16 <= width; x += 16) {
+            uint8x16x4_t pixel = vld4q_u8(source + x * 4);
+            uint8x16x3_t out = { { pixel.val[0], pixel.val[1], pixel.val[2] } };
+            vst3q_u8(destination + x * 3, out);
+        }
+    }
+    return x;
+}
+#elif defined(QTFB_PIXELS_SSE2)
+static int convertRowSIMD(const uint8_t *source, uint8_t *destination, uint8_t format, int width, int y, bool dither) {
+    int x = 0;
+    if(!qtfb::isRGB565(format)) {
+        // RGB888 needs a byte shuffle SSE2 doesn't have - the scalar loop handles it.
+        return 0;
+    }
+    // Offsets for 4 pixels (R, G, B, A bytes each) of row y
+    uint8_t offsets[16] = { 0 };
+    if(dither) {
+        for(int i = 0; i < 4; i++) {
+            offsets[i * 4 + 0] = bayer4[y & 3][i] >> 1;
+            offsets[i * 4 + 1] = bayer4[y & 3][i] >> 2;
+            offsets[i * 4 + 2] = bayer4[y & 3][i] >> 1;
+        }
+    }
+    const __m128i ditherOffsets = _mm_loadu_si128((const __m128i *) offsets);
+    const __m128i maskRed = _mm_set1_epi32(0xF8), maskGreen = _mm_set1_epi32(0xFC00), maskBlue = _mm_set1_epi32(0xF80000);
+    for(; x + 8 <= width; x += 8) {
+        __m128i pixels[2];
+        for(int half = 0; half < 2; half++) {
+            __m128i p = _mm_loadu_si128((const __m128i *) (source + (x + half * 4) * 4));
+            p = _mm_adds_epu8(p, ditherOffsets);
+            __m128i value = _mm_or_si128(
+                _mm_or_si128(_mm_slli_epi32(_mm_and_si128(p, maskRed), 8),
+                             _mm_srli_epi32(_mm_and_si128(p, maskGreen), 5)),
+                _mm_srli_epi32(_mm_and_si128(p, maskBlue), 19));
+            // Sign-extend the low 16 bits, so that the signed pack below is exact.
+            pixels[half] = _mm_srai_epi32(_mm_slli_epi32(value, 16), 16);
+        }
+        _mm_storeu_si128((__m128i *) ((uint16_t *) destination + x), _mm_packs_epi32(pixels[0], pixels[1]));
+    }
+    return x;
+}
+#else
+static int convertRowSIMD(const uint8_t *, uint8_t *, uint8_t, int, int, bool) {
+    return 0;
+}
+#endif
+
+void qtfb::convertFromRGBA8888(const uint8_t *source, size_t sourceStride,
+                               uint8_t *destination, size_t destinationStride, uint8_t format,
+                               int width, int height, bool dither) {
+    dither = dither && isRGB565(format);
+    if(bytesPerPixel(format) == 4) {
+        copyPixels(source, sourceStride, destination, destinationStride, format, width, height);
+        return;
+    }
+    for(int y = 0; y < height; y++) {
+        const uint8_t *sourceRow = source + y * sourceStride;
+        uint8_t *destinationRow = destination + y * destinationStride;
+        int done = convertRowSIMD(sourceRow, destinationRow, format, width, y, dither);
+        convertRowScalar(sourceRow, destinationRow, format, done, width, y, dither);
+    }
+}
+
+void qtfb::copyPixels(const uint8_t *source, size_t sourceStride,
+                      uint8_t *destination, size_t destinationStride, uint8_t format,
+                      int width, int height) {
+    size_t rowBytes = (size_t) width * bytesPerPixel(format);
+    if(sourceStride == destinationStride && sourceStride == rowBytes) {
+        memcpy(destination, source, rowBytes * height);
+        return;
+    }
+    for(int y = 0; y < height; y++) {
+        memcpy(destination + y * destinationStride, source + y * sourceStride, rowBytes);
+    }
+}
+
+void qtfb::fillPixels(uint8_t *destination, size_t destinationStride, uint8_t format,
+                      int width, int height, uint32_t argb) {
+    if(width <= 0 || height <= 0) return;
+    uint32_t value = packColor(format, argb);
+    unsigned int pixelSize = bytesPerPixel(format);
+
+    // Build the first row, then copy it - memcpy is as fast as filling gets.
+    uint8_t *first = destination;
+    if(pixelSize == 2) {
+        uint16_t *row = (uint16_t *) first;
+        for(int x = 0; x < width; x++) row[x] = value;
+    } else if(pixelSize == 4) {
+        uint32_t *row = (uint32_t *) first;
+        for(int x = 0; x < width; x++) row[x] = value;
+    } else {
+        memcpy(first, &value, pixelSize);
+        // Doubling the filled part keeps this at O(log width) memcpy calls.
+        size_t filled = pixelSize, total = (size_t) width * pixelSize;
+        while(filled < total) {
+            size_t chunk = filled < total - filled ? filled : total - filled;
+            memcpy(first + filled, first, chunk);
+            filled += chunk;
+        }
+    }
+    size_t rowBytes = (size_t) width * pixelSize;
+    for(int y = 1; y < height; y++) {
+        memcpy(destination + y * destinationStride, first, rowBytes);
+    }
+}
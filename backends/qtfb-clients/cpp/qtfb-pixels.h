@@ -0,0 +1,33 @@
+#pragma once
+#include "common.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixel conversion, copy and fill for qtfb surfaces, vectorized with NEON (aarch64) or SSE2
+// (x86, for testing off-device). All of them take strides in bytes, so they can work on a
+// part of a surface.
+//
+// Colors are given as 0xAARRGGBB. Surfaces store RGB888 / RGBA8888 with red in the first
+// byte, RGB565 as native (little-endian) 16-bit values.
+namespace qtfb {
+    bool isRGB565(uint8_t format);
+
+    // The value of one pixel of `format`, in its first bytesPerPixel(format) bytes.
+    uint32_t packColor(uint8_t format, uint32_t argb);
+
+    // Converts width x height RGBA8888 pixels (red in the first byte, as most image decoders
+    // produce them) into a surface of `format`. With `dither`, RGB565 targets get ordered
+    // (4x4 Bayer) dithering instead of plain truncation.
+    void convertFromRGBA8888(const uint8_t *source, size_t sourceStride,
+                             uint8_t *destination, size_t destinationStride, uint8_t format,
+                             int width, int height, bool dither = false);
+
+    // Copies width x height pixels between buffers of the same format.
+    void copyPixels(const uint8_t *source, size_t sourceStride,
+                    uint8_t *destination, size_t destinationStride, uint8_t format,
+                    int width, int height);
+
+    // Fills width x height pixels with the color.
+    void fillPixels(uint8_t *destination, size_t destinationStride, uint8_t format,
+                    int width, int height, uint32_t argb);
+}
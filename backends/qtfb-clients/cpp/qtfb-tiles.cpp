@@ -0,0 +1,122 @@
+#include "qtfb-tiles.h"
+#include <algorithm>
+
+qtfb::TileScheduler::TileScheduler(int workers, int tileSize) : _tileSize(tileSize) {
+    if(workers <= 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    for(int i = 0; i < workers; i++) {
+        _workers.push_back(new Worker());
+    }
+    for(int i = 0; i < workers; i++) {
+        _workers[i]->thread = std::thread(&TileScheduler::_workerLoop, this, i);
+    }
+}
+
+qtfb::TileScheduler::~TileScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _workAvailable.notify_all();
+    for(Worker *worker : _workers) {
+        worker->thread.join();
+        delete worker;
+    }
+}
+
+bool qtfb::TileScheduler::_takeTile(int index, DamageRect &tile) {
+    // Own tiles are taken from the front, which keeps a worker walking through neighbouring
+    // tiles. Stolen ones come from the back, furthest away from what their owner works on.
+    {
+        Worker *own = _workers[index];
+        std::lock_guard<std::mutex> lock(own->mutex);
+        if(!own->tiles.empty()) {
+            tile = own->tiles.front();
+            own->tiles.pop_front();
+            return true;
+        }
+    }
+    for(size_t i = 1; i < _workers.size(); i++) {
+        Worker *victim = _workers[(index + i) % _workers.size()];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if(!victim->tiles.empty()) {
+            tile = victim->tiles.back();
+            victim->tiles.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void qtfb::TileScheduler::_workerLoop(int index) {
+    uint64_t seenGeneration = 0;
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _workAvailable.wait(lock, [&] { return _stopping || _generation != seenGeneration; });
+            if(_stopping) return;
+            seenGeneration = _generation;
+        }
+
+        DamageRect tile;
+        while(_takeTile(index, tile)) {
+            // The renderer is set before any tile is queued, and the queue's mutex orders the two.
+            (*_renderer)(tile, index);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _completed.push_back(tile);
+            if(--_remaining == 0 || _completed.size() == 1) {
+                _tilesCompleted.notify_one();
+            }
+        }
+    }
+}
+
+void qtfb::TileScheduler::run(const DamageRect &area, const TileRenderer &renderer, const TileCompleted &onCompleted) {
+    std::vector<DamageRect> tiles;
+    for(int y = area.y; y < area.y + area.h; y += _tileSize) {
+        for(int x = area.x; x < area.x + area.w; x += _tileSize) {
+            tiles.push_back({ x, y, std::min(_tileSize, area.x + area.w - x), std::min(_tileSize, area.y + area.h - y) });
+        }
+    }
+    if(tiles.empty()) return;
+
+    _renderer = &renderer;
+    _remaining = (int) tiles.size();
+    // Hand out contiguous runs of tiles, so each worker starts on a region of its own.
+    size_t perWorker = (tiles.size() + _workers.size() - 1) / _workers.size();
+    for(size_t i = 0; i < _workers.size(); i++) {
+        std::lock_guard<std::mutex> lock(_workers[i]->mutex);
+        size_t begin = std::min(tiles.size(), i * perWorker), end = std::min(tiles.size(), begin + perWorker);
+        _workers[i]->tiles.assign(tiles.begin() + begin, tiles.begin() + end);
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _generation++;
+    _workAvailable.notify_all();
+
+    std::vector<DamageRect> finished;
+    for(;;) {
+        _tilesCompleted.wait(lock, [&] { return !_completed.empty() || _remaining == 0; });
+        finished.swap(_completed);
+        bool done = _remaining == 0;
+        if(onCompleted && !finished.empty()) {
+            lock.unlock();
+            onCompleted(finished);
+            lock.lock();
+        }
+        finished.clear();
+        if(done && _completed.empty()) break;
+    }
+}
+
+bool qtfb::TileScheduler::render(ClientConnection &connection, const DamageRect &area, const TileRenderer &renderer) {
+    DamageRegion damage(connection.width(), connection.height(), _tileSize);
+    // Never switch to a complete update halfway through - the rest of the surface is
+    // still being drawn.
+    damage.completeUpdateThreshold = 2;
+    bool status = true;
+    run(area, renderer, [&](const std::vector<DamageRect> &tiles) {
+        for(const DamageRect &tile : tiles) damage.add(tile);
+        status &= damage.flush(connection);
+    });
+    return status;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include "qtfb-client.h"
+#include "qtfb-damage.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Splits a redraw into tiles and renders them on all cores.
+// Each worker owns a queue of tiles and steals from the others once it runs dry, so one
+// expensive tile doesn't leave the rest of the pool idle.
+//
+//   qtfb::TileScheduler scheduler;
+//   scheduler.render(connection, { 0, 0, connection.width(), connection.height() },
+//       [&](const qtfb::DamageRect &tile, int worker) { ... draw the tile ... });
+namespace qtfb {
+    // Called from a worker thread. Tiles never overlap, so renderers may write to the
+    // shared surface without locking, as long as they stay within their tile.
+    typedef std::function<void(const DamageRect &tile, int worker)> TileRenderer;
+    typedef std::function<void(const std::vector<DamageRect> &tiles)> TileCompleted;
+
+    class TileScheduler {
+    public:
+        // 0 workers means one per core.
+        TileScheduler(int workers = 0, int tileSize = 128);
+        ~TileScheduler();
+
+        // Renders every tile of area and returns once all are done. onCompleted is called
+        // on the calling thread with the tiles which finished since its last call.
+        void run(const DamageRect &area, const TileRenderer &renderer, const TileCompleted &onCompleted = nullptr);
+        // Same, but streams finished tiles to the server as partial updates while the rest
+        // are still being rendered.
+        bool render(ClientConnection &connection, const DamageRect &area, const TileRenderer &renderer);
+
+        int workers() const { return (int) _workers.size(); }
+        int tileSize() const { return _tileSize; }
+
+    private:
+        struct Worker {
+            std::thread thread;
+            std::mutex mutex;
+            std::deque<DamageRect> tiles;
+        };
+
+        int _tileSize;
+        std::vector<Worker *> _workers;
+
+        std::mutex _mutex;
+        std::condition_variable _workAvailable, _tilesCompleted;
+        // Bumped with every run, so idle workers know there's new work.
+        uint64_t _generation = 0;
+        bool _stopping = false;
+        const TileRenderer *_renderer = NULL;
+        std::atomic<int> _remaining { 0 };
+        std::vector<DamageRect> _completed;
+
+        void _workerLoop(int index);
+        bool _takeTile(int index, DamageRect &tile);
+    };
+}
@@ -1,4 +1,4 @@
 #!/bin/sh
 source ~/Tools/remarkable-toolchain/environment-setup-cortexa53-crypto-remarkable-linux
-aarch64-remarkable-linux-g++ --sysroot ~/Tools/remarkable-toolchain/sysroots/cortexa53-crypto-remarkable-linux toyclient.cpp ../../../backends/qtfb-clients/cpp/qtfb-client.cpp -o toyclient_aarch
+aarch64-remarkable-linux-g++ --sysroot ~/Tools/remarkable-toolchain/sysroots/cortexa53-crypto-remarkable-linux toyclient.cpp ../../../backends/qtfb-clients/cpp/qtfb-client.cpp ../../../backends/qtfb-clients/cpp/qtfb-assets.cpp ../../../backends/qtfb-clients/cpp/qtfb-pixels.cpp ../../../backends/qtfb-clients/cpp/qtfb-damage.cpp -o toyclient_aarch
 
@@ -1,3 +1,3 @@
 #!/bin/sh
-g++ toyclient.cpp ../../../backends/qtfb-clients/cpp/qtfb-client.cpp -o toyclient
+g++ toyclient.cpp ../../../backends/qtfb-clients/cpp/qtfb-client.cpp ../../../backends/qtfb-clients/cpp/qtfb-assets.cpp ../../../backends/qtfb-clients/cpp/qtfb-pixels.cpp ../../../backends/qtfb-clients/cpp/qtfb-damage.cpp -o toyclient
 
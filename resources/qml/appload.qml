@@ -14,6 +14,28 @@ Rectangle {
 
     signal requestClose
 
+    // Windows are stacked in creation order. Tell every window whether a window above it
+    // covers it entirely, so that hidden qtfb clients can stop rendering.
+    function updateOcclusion() {
+        let windows = [];
+        for(let i = 0; i < absoluteRoot.children.length; i++) {
+            const child = absoluteRoot.children[i];
+            if(child.occluded !== undefined && child.minimized !== undefined) windows.push(child);
+        }
+        for(let i = 0; i < windows.length; i++) {
+            const below = windows[i];
+            let occluded = false;
+            for(let j = i + 1; j < windows.length && !occluded; j++) {
+                const above = windows[j];
+                if(!above.visible || above.minimized) continue;
+                occluded = above.x <= below.x && above.y <= below.y &&
+                    above.x + above.width >= below.x + below.width &&
+                    above.y + above.height >= below.y + below.height;
+            }
+            below.occluded = occluded;
+        }
+    }
+
     AppLoadLibrary {
         id: library
     }
@@ -160,6 +182,8 @@ Rectangle {
 
                         if(modelData.externalType === 2 /* EXTERNAL_QTFB */) {
                             qtfbKey = Math.floor(Math.random() * 10000000);
+                            // Get the surface ready while the window and the process are being created.
+                            library.preallocateFramebuffer(modelData.id, qtfbKey);
                         }
                         if(modelData.externalType != 1 /* EXTERNAL_NOGUI */) {
                             /* Create a new window*/
@@ -200,7 +224,19 @@ Rectangle {
 
                             win.qtfbKey = qtfbKey;
 
-                            win.closed.connect(() => win.destroy());
+                            win.closed.connect(() => {
+                                // Hidden windows don't cover anything - updateOcclusion() runs through stackingChanged.
+                                win.visible = false;
+                                win.destroy();
+                            });
+                            win.stackingChanged.connect(updateOcclusion);
+                            win.xChanged.connect(updateOcclusion);
+                            win.yChanged.connect(updateOcclusion);
+                            win.widthChanged.connect(updateOcclusion);
+                            win.heightChanged.connect(updateOcclusion);
+                            win.minimizedChanged.connect(updateOcclusion);
+                            // absoluteRoot is not necessarily our own item (xovi), so nothing else tells us about new windows.
+                            updateOcclusion();
 
                         }
                         if(modelData.externalType == 0 /* INTERNAL */) {
@@ -28,12 +28,21 @@ FocusScope {
     property bool minimized: false
     property bool fullscreen: false
     property bool forceTopBarVisible: false
+    // Set by the launcher when other windows cover this one entirely.
+    property bool occluded: false
     // This is defined like that so as it doesn't interfere with minimization
     property var _height: root.globalHeight / 3
     property var beforeFullscreenData: null
 
     // External I/O from this component:
     signal closed
+    // The window may have started or stopped covering the ones below it.
+    signal stackingChanged
+    onVisibleChanged: root.stackingChanged()
+    Component.onDestruction: {
+        // Stop counting as a window above the others before going away.
+        root.visible = false;
+    }
     function loadApplication(appId) {
         coord.loadApplication(appId);
     }
@@ -345,6 +354,7 @@ FocusScope {
 
             visible: qtfbKey != -1
             allowScaling: true
+            occluded: root.occluded
             framebufferID: qtfbKey
             focus: qtfbKey != -1
 
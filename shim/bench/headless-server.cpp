@@ -0,0 +1,148 @@
+// A qtfb server without a compositor, for benchmarking and testing the shim off-device.
+// It hands out SHM surfaces like appload does, and answers every update with a frame credit
+// straight away - nothing is ever painted.
+//
+// With --input-burst N, every update covering the whole surface is also answered with N pen
+// updates, so that the input path can be measured.
+
+#include "../src/qtfb-client/common.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+static int inputBurst = 0;
+
+static bool getFormat(int type, int &width, int &height, int &bytesPerPixel) {
+    switch(type) {
+        case FBFMT_RM2FB: width = RM2_WIDTH; height = RM2_HEIGHT; bytesPerPixel = 2; return true;
+        case FBFMT_RMPP_RGB888: width = RMPP_WIDTH; height = RMPP_HEIGHT; bytesPerPixel = 3; return true;
+        case FBFMT_RMPP_RGBA8888: width = RMPP_WIDTH; height = RMPP_HEIGHT; bytesPerPixel = 4; return true;
+        case FBFMT_RMPP_RGB565: width = RMPP_WIDTH; height = RMPP_HEIGHT; bytesPerPixel = 2; return true;
+        case FBFMT_RMPPM_RGB888: width = RMPPM_WIDTH; height = RMPPM_HEIGHT; bytesPerPixel = 3; return true;
+        case FBFMT_RMPPM_RGBA8888: width = RMPPM_WIDTH; height = RMPPM_HEIGHT; bytesPerPixel = 4; return true;
+        case FBFMT_RMPPM_RGB565: width = RMPPM_WIDTH; height = RMPPM_HEIGHT; bytesPerPixel = 2; return true;
+    }
+    return false;
+}
+
+static void send(int fd, const qtfb::ServerMessage &message) {
+    ::send(fd, &message, sizeof(message), 0);
+}
+
+static void handleClient(int fd) {
+    qtfb::ClientMessage message;
+    int shmKey = -1, width = 0, height = 0;
+    bool frameCredits = false;
+    while(recv(fd, &message, sizeof(message), 0) > 0) {
+        switch(message.type) {
+            case MESSAGE_INITIALIZE:
+            case MESSAGE_CUSTOM_INITIALIZE: {
+                int bytesPerPixel;
+                if(!getFormat(message.init.framebufferType, width, height, bytesPerPixel)) goto end;
+                if(message.type == MESSAGE_CUSTOM_INITIALIZE) {
+                    width = message.customInit.width;
+                    height = message.customInit.height;
+                }
+                shmKey = (rand() & 0xFFFFFF) | 1;
+                FORMAT_SHM(shmName, shmKey);
+                int shm = shm_open(shmName, O_RDWR | O_CREAT, 0600);
+                size_t shmSize = (size_t) width * height * bytesPerPixel;
+                ftruncate(shm, shmSize);
+                close(shm);
+
+                qtfb::ServerMessage response = { .type = MESSAGE_INITIALIZE };
+                response.init.shmKeyDefined = shmKey;
+                response.init.shmSize = shmSize;
+                send(fd, response);
+                break;
+            }
+            case MESSAGE_RECONFIGURE: {
+                int defaultWidth, defaultHeight, bytesPerPixel;
+                if(shmKey == -1 || !getFormat(message.reconfigure.framebufferType, defaultWidth, defaultHeight, bytesPerPixel)) goto end;
+                width = message.reconfigure.width ? message.reconfigure.width : defaultWidth;
+                height = message.reconfigure.height ? message.reconfigure.height : defaultHeight;
+                size_t shmSize = (size_t) width * height * bytesPerPixel;
+                FORMAT_SHM(shmName, shmKey);
+                int shm = shm_open(shmName, O_RDWR, 0);
+                ftruncate(shm, shmSize);
+                close(shm);
+
+                qtfb::ServerMessage response = { .type = MESSAGE_RECONFIGURE };
+                response.reconfigure.shmKeyDefined = shmKey;
+                response.reconfigure.width = width;
+                response.reconfigure.height = height;
+                response.reconfigure.shmSize = shmSize;
+                response.reconfigure.stride = width * bytesPerPixel;
+                response.reconfigure.framebufferType = message.reconfigure.framebufferType;
+                send(fd, response);
+                break;
+            }
+            case MESSAGE_REQUEST_FRAME_CREDITS:
+                frameCredits = true;
+                break;
+            case MESSAGE_UPDATE: {
+                if(frameCredits) send(fd, { .type = MESSAGE_FRAME_CREDIT });
+                bool complete = message.update.type == UPDATE_ALL ||
+                    (message.update.x == 0 && message.update.y == 0 && message.update.w >= width && message.update.h >= height);
+                if(complete) {
+                    qtfb::ServerMessage input = { .type = MESSAGE_USERINPUT };
+                    for(int i = 0; i < inputBurst; i++) {
+                        input.userInput = { INPUT_PEN_UPDATE, 0, i % width, i % height, 50 };
+                        send(fd, input);
+                    }
+                }
+                break;
+            }
+            case MESSAGE_TERMINATE:
+                goto end;
+        }
+    }
+end:
+    if(shmKey != -1) {
+        FORMAT_SHM(shmName, shmKey);
+        shm_unlink(shmName);
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--input-burst") == 0 && i + 1 < argc) {
+            inputBurst = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--input-burst N]\n", argv[0]);
+            return 1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    // Never take the socket away from a running appload.
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if(connect(probe, (struct sockaddr *) &address, sizeof(address)) == 0) {
+        fprintf(stderr, "A qtfb server is already listening on %s\n", SOCKET_PATH);
+        return 1;
+    }
+    close(probe);
+
+    int server = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    unlink(SOCKET_PATH);
+    if(bind(server, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+        perror("Failed to listen on the qtfb socket");
+        return 1;
+    }
+    for(;;) {
+        int client = accept(server, NULL, NULL);
+        if(client == -1) continue;
+        std::thread(handleClient, client).detach();
+    }
+}
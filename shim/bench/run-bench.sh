@@ -0,0 +1,21 @@
+#!/bin/sh
+# Usage: run-bench.sh <build directory> [iterations]
+# Runs shim-bench without and with the shim, against a headless server.
+set -e
+BUILD="$1"
+ITERATIONS="${2:-100000}"
+BURST=10000
+TEMP="$(mktemp -d)"
+
+"$BUILD/qtfb-headless-server" --input-burst $BURST &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null; rm -rf "$TEMP"' EXIT
+sleep 0.2
+kill -0 $SERVER
+
+touch "$TEMP/digitizer"
+"$BUILD/qtfb-shim-bench" "$ITERATIONS"
+QTFB_KEY=1 \
+QTFB_SHIM_INPUT_PATH_DIGITIZER="$TEMP/digitizer" \
+QTFB_BENCH_INPUT_BURST=$BURST \
+LD_PRELOAD="$BUILD/qtfb-shim.so" "$BUILD/qtfb-shim-bench" "$ITERATIONS"
@@ -0,0 +1,177 @@
+// Measures what LD_PRELOAD=qtfb-shim.so costs an app. Run it once without and once with the
+// shim (run-bench.sh does both) against the headless server, and compare.
+//
+// The input benchmarks need QTFB_SHIM_INPUT_PATH_DIGITIZER to name a file, which the shim
+// then treats as the digitizer.
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fb.h>
+#include <linux/input.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+
+// From mxcfb.h, as the shim decodes them
+#define MXCFB_SEND_UPDATE 0x4048462e
+#define MXCFB_WAIT_FOR_UPDATE_COMPLETE 0x4048462f
+
+struct mxcfb_rect { uint32_t top, left, width, height; };
+struct mxcfb_update_data {
+    struct mxcfb_rect update_region;
+    uint32_t waveform_mode, update_mode, update_marker;
+    int temp;
+    unsigned int flags;
+    int dither_mode, quant_bit;
+    uint32_t alt_buffer_data[8];
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static void report(const char *name, int iterations, Clock::duration elapsed) {
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    printf("%-36s %10d %14.1f ns/op\n", name, iterations, ns / iterations);
+}
+
+static void measure(const char *name, int iterations, const std::function<void()> &operation) {
+    // Warm up - the first calls resolve symbols and connect the shim.
+    for(int i = 0; i < iterations / 10 + 1; i++) operation();
+    auto start = Clock::now();
+    for(int i = 0; i < iterations; i++) operation();
+    report(name, iterations, Clock::now() - start);
+}
+
+static void skip(const char *name, const char *reason) {
+    printf("%-36s %10s   (skipped: %s)\n", name, "-", reason);
+}
+
+static void benchOrdinaryFiles(int iterations) {
+    char path[] = "/tmp/qtfb-shim-bench-XXXXXX";
+    int temp = mkstemp(path);
+    write(temp, "0123456789", 10);
+    close(temp);
+
+    measure("open + close (regular file)", iterations, [&]() {
+        close(open(path, O_RDONLY));
+    });
+    measure("fopen + fclose (regular file)", iterations / 4, [&]() {
+        fclose(fopen(path, "r"));
+    });
+    int fd = open(path, O_RDONLY);
+    measure("ioctl FIONREAD (regular file)", iterations, [&]() {
+        int available;
+        ioctl(fd, FIONREAD, &available);
+    });
+    close(fd);
+    unlink(path);
+}
+
+static void benchFramebuffer(int iterations) {
+    int fb = open("/dev/fb0", O_RDWR);
+    if(fb == -1) {
+        skip("framebuffer", "no /dev/fb0");
+        return;
+    }
+    measure("open + close (/dev/fb0)", iterations, []() {
+        close(open("/dev/fb0", O_RDWR));
+    });
+    measure("ioctl FBIOGET_VSCREENINFO", iterations, [&]() {
+        struct fb_var_screeninfo info;
+        ioctl(fb, FBIOGET_VSCREENINFO, &info);
+    });
+
+    struct fb_var_screeninfo info;
+    ioctl(fb, FBIOGET_VSCREENINFO, &info);
+    measure("MXCFB_SEND_UPDATE + WAIT (round trip)", iterations / 10, [&]() {
+        struct mxcfb_update_data update = {};
+        update.update_region = { 0, 0, 32, 32 };
+        ioctl(fb, MXCFB_SEND_UPDATE, &update);
+        uint32_t marker = 0;
+        ioctl(fb, MXCFB_WAIT_FOR_UPDATE_COMPLETE, &marker);
+    });
+    measure("MXCFB_SEND_UPDATE (coalesced)", iterations, [&]() {
+        struct mxcfb_update_data update = {};
+        update.update_region = { 0, 0, 32, 32 };
+        ioctl(fb, MXCFB_SEND_UPDATE, &update);
+    });
+    close(fb);
+}
+
+static void benchInput(int iterations) {
+    const char *digitizer = getenv("QTFB_SHIM_INPUT_PATH_DIGITIZER");
+    if(digitizer == NULL) {
+        skip("input", "QTFB_SHIM_INPUT_PATH_DIGITIZER not set");
+        return;
+    }
+    int pen = open(digitizer, O_RDONLY);
+    if(pen == -1) {
+        skip("input", "cannot open the digitizer");
+        return;
+    }
+    measure("ioctl EVIOCGABS (digitizer)", iterations, [&]() {
+        struct input_absinfo info;
+        ioctl(pen, EVIOCGABS(ABS_X), &info);
+    });
+
+    int burst = atoi(getenv("QTFB_BENCH_INPUT_BURST") ? getenv("QTFB_BENCH_INPUT_BURST") : "0");
+    int fb = open("/dev/fb0", O_RDWR);
+    struct fb_var_screeninfo info;
+    if(burst <= 0 || fb == -1 || ioctl(fb, FBIOGET_VSCREENINFO, &info) != 0) {
+        skip("input delivery", "no input burst configured");
+        close(pen);
+        return;
+    }
+
+    // A full-screen update makes the headless server send the burst.
+    struct mxcfb_update_data update = {};
+    update.update_region = { 0, 0, info.xres, info.yres };
+    auto start = Clock::now();
+    ioctl(fb, MXCFB_SEND_UPDATE, &update);
+    uint32_t marker = 0;
+    ioctl(fb, MXCFB_WAIT_FOR_UPDATE_COMPLETE, &marker);
+
+    int frames = 0;
+    struct input_event events[64];
+    struct pollfd pfd = { .fd = pen, .events = POLLIN };
+    auto last = start;
+    // The shim drops frames the app doesn't read in time - so stop once the stream dries up.
+    while(frames < burst && poll(&pfd, 1, 500) > 0) {
+        ssize_t bytes = read(pen, events, sizeof(events));
+        if(bytes <= 0) break;
+        for(int i = 0; i < bytes / (ssize_t) sizeof(struct input_event); i++) {
+            if(events[i].type == EV_SYN) frames++;
+        }
+        last = Clock::now();
+    }
+    auto elapsed = last - start;
+    if(frames < burst) {
+        printf("input delivery: %d of %d frames arrived, the rest were dropped\n", frames, burst);
+    }
+    report("input delivery (per SYN frame)", frames, elapsed);
+    printf("%-36s %10d %14.0f frames/s\n", "input delivery rate", frames,
+        frames / std::chrono::duration<double>(elapsed).count());
+    close(fb);
+    close(pen);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    const char *preload = getenv("LD_PRELOAD");
+    bool shimLoaded = preload != NULL && strstr(preload, "qtfb-shim") != NULL;
+    printf("# %s the shim, %d iterations\n", shimLoaded ? "With" : "Without", iterations);
+
+    benchOrdinaryFiles(iterations);
+    if(shimLoaded) {
+        benchFramebuffer(iterations);
+        benchInput(iterations);
+    } else {
+        skip("framebuffer / input", "the shim is not loaded");
+    }
+    return 0;
+}
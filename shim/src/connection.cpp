@@ -1,5 +1,9 @@
 #include "qtfb-client/qtfb-client.h"
 #include "shim.h"
+#include "fdset.h"
+#include "input-shim.h"
+#include <atomic>
+#include <mutex>
 
 qtfb::FBKey shimFramebufferKey;
 uint8_t shimType = FBFMT_RM2FB;
@@ -21,9 +25,27 @@ void connectShim(){
     if(shmFD == -1) {
         CERR << "Connecting to the shim step2!" << std::endl;
         clientConnection = new qtfb::ClientConnection(shimFramebufferKey, shimType, {}, false);
+        // The polling thread reads everything the server sends, so credits are safe to take.
+        clientConnection->requestFrameCredits();
         shmFD = clientConnection->shmFD;
+        markShimFD(shmFD);
         shmMemory = clientConnection->shm;
 
         atexit([](){ if(initiatorPID == getpid()) delete clientConnection; });
     }
 }
+
+// Connecting means attaching to the SHM and starting the polling thread. Most processes
+// which inherit LD_PRELOAD (shells, helper scripts) never touch the framebuffer or input
+// devices, so this only happens on the first open() of one of them.
+static std::atomic<bool> shimConnected(false);
+static std::mutex shimConnectMutex;
+
+void ensureShimConnected() {
+    if(shimConnected.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(shimConnectMutex);
+    if(shimConnected.load(std::memory_order_relaxed)) return;
+    connectShim();
+    startPollingThread();
+    shimConnected.store(true, std::memory_order_release);
+}
@@ -9,3 +9,4 @@ extern qtfb::ClientConnection *clientConnection;
 extern void *shmMemory;
 extern int shmFD;
 void connectShim();
+void ensureShimConnected();
@@ -0,0 +1,142 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <initializer_list>
+#include <linux/input-event-codes.h>
+
+// Everything the input shim needs to know about the device it pretends to be.
+// To emulate a new device, add its profile to the deviceProfiles table below - it can then
+// be selected by name with QTFB_SHIM_INPUT_MODE.
+
+#define AXIS_SOURCE_X 0
+#define AXIS_SOURCE_Y 1
+#define AXIS_SOURCE_PRESSURE 2
+
+// Range of the value coming from the server: the framebuffer's width / height, or the
+// pressure, which is always 0-100.
+#define AXIS_RANGE_WIDTH 0
+#define AXIS_RANGE_HEIGHT 1
+#define AXIS_RANGE_PERCENT 2
+
+// How one emulated axis is derived from the server's userInput message.
+struct AxisProfile {
+    uint8_t source;
+    uint8_t range;
+    int32_t maximum;
+    bool inverted;
+};
+
+#define PROFILE_BITS_PER_LONG (sizeof(unsigned long) * 8)
+#define PROFILE_NLONGS(x) ((((x) - 1) / PROFILE_BITS_PER_LONG) + 1)
+
+// The bitmap an EVIOCGBIT ioctl answers with.
+template<size_t Count> struct CapabilityBits {
+    unsigned long bits[PROFILE_NLONGS(Count)] = {};
+
+    constexpr CapabilityBits(std::initializer_list<int> codes) {
+        for(int code : codes) {
+            bits[code / PROFILE_BITS_PER_LONG] |= 1UL << (code % PROFILE_BITS_PER_LONG);
+        }
+    }
+};
+
+typedef CapabilityBits<EV_CNT> EventBits;
+typedef CapabilityBits<ABS_CNT> AbsBits;
+typedef CapabilityBits<KEY_CNT> KeyBits;
+
+struct InputDeviceProfile {
+    const char *name;
+    EventBits events;
+    AbsBits abs;
+    KeyBits keys;
+};
+
+struct DeviceProfile {
+    const char *name;
+
+    const char *pathDigitizer, *pathTouchScreen, *pathButtons;
+
+    AxisProfile touchX, touchY;
+    AxisProfile penX, penY, pressure;
+    int32_t minOrientation, maxOrientation;
+    int32_t maxTouchSlot;
+
+    InputDeviceProfile touchScreen, digitizer, buttons;
+};
+
+#define RM1_TOUCHSCREEN_CAPS { \
+    "cyttsp5_mt", \
+    { EV_ABS, EV_REL }, \
+    { ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_PRESSURE, ABS_MT_TOUCH_MAJOR, ABS_MT_TOUCH_MINOR, \
+      ABS_MT_ORIENTATION, ABS_MT_SLOT, ABS_MT_TOOL_TYPE, ABS_MT_TRACKING_ID }, \
+    {}, \
+}
+#define RM1_DIGITIZER_CAPS { \
+    "Wacom I2C Digitizer", \
+    { EV_ABS, EV_KEY, EV_SYN }, \
+    { ABS_X, ABS_Y, ABS_PRESSURE, ABS_DISTANCE, ABS_TILT_X, ABS_TILT_Y }, \
+    { BTN_TOOL_PEN, BTN_TOOL_RUBBER, BTN_TOUCH, BTN_STYLUS, BTN_STYLUS2 }, \
+}
+#define RM1_BUTTONS_CAPS { \
+    "gpio_buttons", \
+    { EV_SYN, EV_KEY }, \
+    {}, \
+    { KEY_HOME, KEY_LEFT, KEY_RIGHT, KEY_WAKEUP, KEY_POWER }, \
+}
+
+// Indices into deviceProfiles - these are also the SHIM_INPUT_* / DEV_TYPE_* values.
+constexpr DeviceProfile deviceProfiles[] = {
+    {
+        "RM1",
+        "/dev/input/event0", "/dev/input/event2", "/dev/input/event1",
+        // The rM1's touchscreen is mounted upside down, and its digitizer is rotated.
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 767, true },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 1023, true },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 20967, true },
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 15725, false },
+        { AXIS_SOURCE_PRESSURE, AXIS_RANGE_PERCENT, 4096, false },
+        -127, 127,
+        3,
+        RM1_TOUCHSCREEN_CAPS, RM1_DIGITIZER_CAPS, RM1_BUTTONS_CAPS,
+    },
+    {
+        "RMPP",
+        "/dev/input/event2", "/dev/input/event3", "<NONEXISTENT>",
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 2064, false },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 2832, false },
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 11180, false },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 15340, false },
+        { AXIS_SOURCE_PRESSURE, AXIS_RANGE_PERCENT, 255, false },
+        -127, 127,
+        3,
+        RM1_TOUCHSCREEN_CAPS, RM1_DIGITIZER_CAPS, RM1_BUTTONS_CAPS,
+    },
+    {
+        "RMPPM",
+        "/dev/input/event2", "/dev/input/event3", "<NONEXISTENT>",
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 1248, false },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 2208, false },
+        { AXIS_SOURCE_X, AXIS_RANGE_WIDTH, 6760, false },
+        { AXIS_SOURCE_Y, AXIS_RANGE_HEIGHT, 11960, false },
+        { AXIS_SOURCE_PRESSURE, AXIS_RANGE_PERCENT, 255, false },
+        -127, 127,
+        3,
+        RM1_TOUCHSCREEN_CAPS, RM1_DIGITIZER_CAPS, RM1_BUTTONS_CAPS,
+    },
+};
+
+#define DEVICE_PROFILE_COUNT ((int) (sizeof(deviceProfiles) / sizeof(deviceProfiles[0])))
+
+static_assert(DEVICE_PROFILE_COUNT > 0, "At least one device profile is required");
+
+// Returns the index of the profile called `name`, or -1.
+constexpr int findDeviceProfile(const char *name) {
+    for(int i = 0; i < DEVICE_PROFILE_COUNT; i++) {
+        const char *a = deviceProfiles[i].name, *b = name;
+        while(*a && *a == *b) { a++; b++; }
+        if(*a == *b) return i;
+    }
+    return -1;
+}
+
+static_assert(findDeviceProfile("RM1") == 0, "RM1 must stay the first (default) profile");
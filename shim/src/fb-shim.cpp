@@ -1,8 +1,17 @@
 #include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <unistd.h>
 #include "fb-shim.h"
 #include "connection.h"
 #include "shim.h"
 #include "qtfb-client/qtfb-client.h"
+#include "qtfb-client/qtfb-damage.h"
 
 // Ehhh..
 #include <linux/fb.h>
@@ -12,8 +21,15 @@
 #define _IOW(_, nr, __) (nr | 0x40484600)
 #include "mxcfb.h"
 
-#define BYTES_PER_PIXEL 2
 #define FILE_FB "/dev/fb0"
+// Upper bound for MXCFB_WAIT_FOR_UPDATE_COMPLETE, in case the frame never gets painted.
+#define UPDATE_COMPLETE_TIMEOUT_MS 250
+// How long FBIOPUT_VSCREENINFO waits for the server to hand out the new surface
+#define RECONFIGURE_TIMEOUT_MS 1000
+// Defaults for QTFB_SHIM_COALESCE_MS (0 disables coalescing) and QTFB_SHIM_COALESCE_FLUSH_AREA
+// (percentage of the screen after which damage is sent right away)
+#define DEFAULT_COALESCE_MS 4
+#define DEFAULT_COALESCE_FLUSH_AREA 50
 
 #ifdef _32BITFIXEDINFO
 struct _32_bit_fb_fix_screeninfo {
@@ -39,8 +55,317 @@ struct _32_bit_fb_fix_screeninfo {
 #endif
 
 
+// Updates aren't forwarded while the window isn't visible. A full update is sent
+// as soon as it's shown again, if anything was drawn in the meantime.
+static std::atomic<bool> updatesPaused(false), updatesPending(false);
+
+void fbShimSetVisibility(int state) {
+    bool paused = state != VISIBILITY_VISIBLE;
+    updatesPaused = paused;
+    if(!paused && updatesPending.exchange(false)) {
+        clientConnection->sendCompleteUpdate();
+    }
+}
+
+// A frame is in flight from the moment an update is sent until the server grants a
+// frame credit for it. MXCFB_WAIT_FOR_UPDATE_COMPLETE waits for that.
+static std::mutex frameCreditMutex;
+static std::condition_variable frameCreditGranted;
+static bool frameInFlight = false;
+
+void fbShimFrameCredit() {
+    {
+        std::lock_guard<std::mutex> lock(frameCreditMutex);
+        frameInFlight = false;
+    }
+    frameCreditGranted.notify_all();
+}
+
+static void sendUpdate(int x, int y, int w, int h) {
+    {
+        std::lock_guard<std::mutex> lock(frameCreditMutex);
+        frameInFlight = true;
+    }
+    clientConnection->sendPartialUpdate(x, y, w, h);
+}
+
+// Legacy apps tend to send many small updates per frame. Instead of forwarding each one,
+// their damage is collected into a few rects (overlapping or nearby ones are merged, distant
+// ones are kept apart), which the flush thread sends once the deadline passes - or earlier,
+// if they cover too much of the screen or the app waits for completion.
+static int coalesceMs = DEFAULT_COALESCE_MS;
+static int coalesceFlushArea = DEFAULT_COALESCE_FLUSH_AREA;
+
+static std::mutex damageMutex;
+static std::condition_variable damageQueued;
+static bool damagePending = false;
+// Exact rects - e-ink refreshes whatever it is told to, so no growing them to a tile grid.
+static qtfb::DamageRegion damage(0, 0, 1);
+static int damageWidth = 0, damageHeight = 0;
+static std::chrono::steady_clock::time_point damageDeadline;
+
+static std::thread flushThread;
+static bool flushThreadStop = false;
+// Like the input polling thread, the flush thread only exists in the process which started it.
+static int flushThreadOwnerPID = 0;
+
+void fbShimConfigure() {
+    char *value;
+    if((value = getenv("QTFB_SHIM_COALESCE_MS")) != NULL) {
+        coalesceMs = std::max(0, atoi(value));
+    }
+    if((value = getenv("QTFB_SHIM_COALESCE_FLUSH_AREA")) != NULL) {
+        coalesceFlushArea = std::clamp(atoi(value), 0, 100);
+    }
+}
+
+// Must be called with damageMutex held. Releases it while sending.
+static void flushDamageLocked(std::unique_lock<std::mutex> &lock) {
+    if(!damagePending) return;
+    damagePending = false;
+    std::vector<qtfb::DamageRect> rects = damage.rects();
+    damage.clear();
+    lock.unlock();
+    for(const qtfb::DamageRect &rect : rects) {
+        sendUpdate(rect.x, rect.y, rect.w, rect.h);
+    }
+    lock.lock();
+}
+
+static void flushDamage() {
+    std::unique_lock<std::mutex> lock(damageMutex);
+    flushDamageLocked(lock);
+}
+
+static void flushThreadMain() {
+    std::unique_lock<std::mutex> lock(damageMutex);
+    while(!flushThreadStop) {
+        if(!damagePending) {
+            damageQueued.wait(lock);
+        } else if(damageQueued.wait_until(lock, damageDeadline) == std::cv_status::timeout) {
+            flushDamageLocked(lock);
+        }
+    }
+    flushDamageLocked(lock);
+}
+
+static void stopFlushThread() {
+    if(flushThreadOwnerPID != getpid() || !flushThread.joinable()) return;
+    {
+        std::lock_guard<std::mutex> lock(damageMutex);
+        flushThreadStop = true;
+    }
+    damageQueued.notify_all();
+    flushThread.join();
+}
+
+static void queueUpdate(int x, int y, int w, int h) {
+    if(coalesceMs == 0 || (flushThreadOwnerPID != 0 && flushThreadOwnerPID != getpid())) {
+        sendUpdate(x, y, w, h);
+        return;
+    }
+    if(w <= 0 || h <= 0) return;
+
+    std::unique_lock<std::mutex> lock(damageMutex);
+    if(flushThreadOwnerPID == 0) {
+        flushThreadOwnerPID = getpid();
+        flushThread = std::thread(flushThreadMain);
+        atexit(stopFlushThread);
+    }
+
+    if(damageWidth != clientConnection->width() || damageHeight != clientConnection->height()) {
+        // Reconfigured - whatever is pending refers to the old surface.
+        flushDamageLocked(lock);
+        damageWidth = clientConnection->width();
+        damageHeight = clientConnection->height();
+        damage.resize(damageWidth, damageHeight);
+        // The flush area threshold decides when to send, not the region.
+        damage.completeUpdateThreshold = 2.0;
+    }
+
+    damage.add(x, y, w, h);
+    if(damage.empty()) return;
+    if(!damagePending) {
+        damagePending = true;
+        damageDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(coalesceMs);
+        damageQueued.notify_one();
+    }
+
+    if(damage.dirtyFraction() * 100 >= coalesceFlushArea) {
+        flushDamageLocked(lock);
+    }
+}
+
+// Pixel layout of a qtfb format, in the terms of fb_var_screeninfo. The offsets are those
+// of a little-endian pixel value - RGB888 / RGBA8888 surfaces store red in the first byte.
+struct PixelLayout {
+    int bitsPerPixel;
+    fb_bitfield red, green, blue, transp;
+};
+
+static PixelLayout getPixelLayout(uint8_t format) {
+    switch(format) {
+        case FBFMT_RMPP_RGB888:
+        case FBFMT_RMPPM_RGB888:
+            return { 24, { 0, 8, 0 }, { 8, 8, 0 }, { 16, 8, 0 }, { 0, 0, 0 } };
+        case FBFMT_RMPP_RGBA8888:
+        case FBFMT_RMPPM_RGBA8888:
+            return { 32, { 0, 8, 0 }, { 8, 8, 0 }, { 16, 8, 0 }, { 24, 8, 0 } };
+        default:
+            return { 16, { 11, 5, 0 }, { 5, 6, 0 }, { 0, 5, 0 }, { 0, 0, 0 } };
+    }
+}
+
+// The format of the current family (rMPP / rMPP move) with the requested depth, or -1.
+// The rM2 format only exists as RGB565 - deeper surfaces use the rMPP formats with the
+// current resolution.
+static int getFormatForDepth(uint8_t current, int bitsPerPixel) {
+    bool move = current == FBFMT_RMPPM_RGB888 || current == FBFMT_RMPPM_RGBA8888 || current == FBFMT_RMPPM_RGB565;
+    switch(bitsPerPixel) {
+        case 16:
+            if(current == FBFMT_RM2FB) return FBFMT_RM2FB;
+            return move ? FBFMT_RMPPM_RGB565 : FBFMT_RMPP_RGB565;
+        case 24:
+            return move ? FBFMT_RMPPM_RGB888 : FBFMT_RMPP_RGB888;
+        case 32:
+            return move ? FBFMT_RMPPM_RGBA8888 : FBFMT_RMPP_RGBA8888;
+    }
+    return -1;
+}
+
+static void fillVarScreenInfo(fb_var_screeninfo *screeninfo) {
+    PixelLayout layout = getPixelLayout(clientConnection->format());
+    screeninfo->xres = clientConnection->width();
+    screeninfo->yres = clientConnection->height();
+    screeninfo->grayscale = 0;
+    screeninfo->bits_per_pixel = layout.bitsPerPixel;
+    screeninfo->xres_virtual = clientConnection->width();
+    screeninfo->yres_virtual = clientConnection->height();
+
+    screeninfo->red = layout.red;
+    screeninfo->green = layout.green;
+    screeninfo->blue = layout.blue;
+    screeninfo->transp = layout.transp;
+}
+
+static std::mutex reconfigureMutex;
+static std::condition_variable reconfigureDone;
+static bool reconfigurePending = false;
+
+// Called by the input polling thread, once the client library has mapped the new surface.
+void fbShimReconfigured() {
+    // The app holds on to the fd it got from open("/dev/fb0") - keep that one pointing at
+    // the surface, should the server ever hand out a different SHM object.
+    if(clientConnection->shmFD != shmFD) {
+        dup2(clientConnection->shmFD, shmFD);
+        close(clientConnection->shmFD);
+        clientConnection->shmFD = shmFD;
+    }
+    shmMemory = clientConnection->shm;
+    {
+        std::lock_guard<std::mutex> lock(reconfigureMutex);
+        reconfigurePending = false;
+    }
+    reconfigureDone.notify_all();
+}
+
+static int renegotiate(fb_var_screeninfo *screeninfo) {
+    int format = getFormatForDepth(clientConnection->format(), screeninfo->bits_per_pixel);
+    if(format == -1) {
+        CERR << "Unsupported depth requested: " << screeninfo->bits_per_pixel << std::endl;
+        errno = EINVAL;
+        return -1;
+    }
+    int width = screeninfo->xres ? screeninfo->xres : clientConnection->width();
+    int height = screeninfo->yres ? screeninfo->yres : clientConnection->height();
+    if(format == clientConnection->format() && width == clientConnection->width() && height == clientConnection->height()) {
+        fillVarScreenInfo(screeninfo);
+        return 0;
+    }
+
+    // Nothing drawn into the old surface should get lost.
+    flushDamage();
+    std::unique_lock<std::mutex> lock(reconfigureMutex);
+    reconfigurePending = true;
+    clientConnection->requestReconfigure(format, width, height);
+    if(!reconfigureDone.wait_for(lock, std::chrono::milliseconds(RECONFIGURE_TIMEOUT_MS), []() { return !reconfigurePending; })) {
+        CERR << "The server did not reconfigure the framebuffer in time" << std::endl;
+        reconfigurePending = false;
+        errno = EIO;
+        return -1;
+    }
+    fillVarScreenInfo(screeninfo);
+    return 0;
+}
+
+static void markDamaged(int x, int y, int w, int h) {
+    if(updatesPaused) {
+        updatesPending = true;
+        return;
+    }
+    queueUpdate(x, y, w, h);
+}
+
+// Apps which write() their frames to /dev/fb0 never send MXCFB_SEND_UPDATE. The rows
+// covered by the written bytes become the damage instead.
+static void markRangeDamaged(off64_t offset, size_t length) {
+    int stride = clientConnection->stride(), width = clientConnection->width(), height = clientConnection->height();
+    if(length == 0 || stride == 0 || width == 0) return;
+    int bytesPerPixel = stride / width;
+    off64_t end = offset + length - 1;
+    int firstRow = offset / stride, lastRow = std::min<off64_t>(end / stride, height - 1);
+    if(firstRow > lastRow) return;
+    if(firstRow == lastRow) {
+        int left = (offset % stride) / bytesPerPixel;
+        int right = std::min((int) (end % stride) / bytesPerPixel, width - 1);
+        if(left <= right) markDamaged(left, firstRow, right - left + 1, 1);
+        return;
+    }
+    markDamaged(0, firstRow, width, lastRow - firstRow + 1);
+}
+
+// Writes are limited to the surface - the SHM object behind it may be larger (pooled).
+static ssize_t writeSurface(int fd, const void *buffer, size_t count, off64_t offset) {
+    off64_t size = clientConnection->shmSize;
+    if(offset < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if(offset >= size) {
+        if(count == 0) return 0;
+        errno = EFBIG;
+        return -1;
+    }
+    count = std::min<off64_t>(count, size - offset);
+    ssize_t written = REAL(pwrite64)(fd, buffer, count, offset);
+    if(written > 0) markRangeDamaged(offset, written);
+    return written;
+}
+
+ssize_t fbShimWrite(int fd, const void *buffer, size_t count) {
+    if(fd != shmFD) return INTERNAL_SHIM_NOT_APPLICABLE;
+    off64_t offset = REAL(lseek64)(fd, 0, SEEK_CUR);
+    if(offset == -1) return -1;
+    ssize_t written = writeSurface(fd, buffer, count, offset);
+    if(written > 0) REAL(lseek64)(fd, offset + written, SEEK_SET);
+    return written;
+}
+
+ssize_t fbShimPwrite(int fd, const void *buffer, size_t count, off64_t offset) {
+    if(fd != shmFD) return INTERNAL_SHIM_NOT_APPLICABLE;
+    return writeSurface(fd, buffer, count, offset);
+}
+
+off64_t fbShimLseek(int fd, off64_t offset, int whence) {
+    // SEEK_SET / SEEK_CUR work on the SHM fd as-is. The end is that of the surface, though.
+    if(fd != shmFD || whence != SEEK_END) return INTERNAL_SHIM_NOT_APPLICABLE;
+    return REAL(lseek64)(fd, (off64_t) clientConnection->shmSize + offset, SEEK_SET);
+}
+
 int fbShimOpen(const char *file) {
-    return strcmp(file, FILE_FB) == 0 ? shmFD : INTERNAL_SHIM_NOT_APPLICABLE; 
+    if(strcmp(file, FILE_FB) != 0) return INTERNAL_SHIM_NOT_APPLICABLE;
+    ensureShimConnected();
+    return shmFD;
 }
 
 int fbShimClose(int fd) {
@@ -51,7 +376,7 @@ int fbShimIoctl(int fd, unsigned long request, char *ptr) {
     if (fd == shmFD) {
         if (request == MXCFB_SEND_UPDATE) {
             mxcfb_update_data *update = (mxcfb_update_data *) ptr;
-            clientConnection->sendPartialUpdate(
+            markDamaged(
                 update->update_region.left,
                 update->update_region.top,
                 update->update_region.width,
@@ -61,33 +386,24 @@ int fbShimIoctl(int fd, unsigned long request, char *ptr) {
         } else if (request == MXCFB_SET_AUTO_UPDATE_MODE) {
             return 0;
         } else if (request == MXCFB_WAIT_FOR_UPDATE_COMPLETE) {
-            // TODO ??
+            flushDamage();
+            std::unique_lock<std::mutex> lock(frameCreditMutex);
+            frameCreditGranted.wait_for(lock, std::chrono::milliseconds(UPDATE_COMPLETE_TIMEOUT_MS), []() {
+                return !frameInFlight || updatesPaused;
+            });
             return 0;
         }
         else if (request == FBIOGET_VSCREENINFO) {
-            fb_var_screeninfo *screeninfo = (fb_var_screeninfo *)ptr;
-            screeninfo->xres = clientConnection->width();
-            screeninfo->yres = clientConnection->height();
-            screeninfo->grayscale = 0;
-            screeninfo->bits_per_pixel = 8 * BYTES_PER_PIXEL;
-            screeninfo->xres_virtual = clientConnection->width();
-            screeninfo->yres_virtual = clientConnection->height();
-
-            screeninfo->red.offset = 11;
-            screeninfo->red.length = 5;
-            screeninfo->green.offset = 5;
-            screeninfo->green.length = 6;
-            screeninfo->blue.offset = 0;
-            screeninfo->blue.length = 5;
+            fillVarScreenInfo((fb_var_screeninfo *) ptr);
             return 0;
         }
         else if (request == FBIOPUT_VSCREENINFO) {
-            return 0;
+            return renegotiate((fb_var_screeninfo *) ptr);
         } else if (request == FBIOGET_FSCREENINFO) {
             remapped_fb_var_screeninfo *screeninfo = (remapped_fb_var_screeninfo *)ptr;
             screeninfo->smem_len = clientConnection->shmSize;
             screeninfo->smem_start = (unsigned long) shmMemory;
-            screeninfo->line_length = clientConnection->width() * BYTES_PER_PIXEL;
+            screeninfo->line_length = clientConnection->stride();
             constexpr char fb_id[] = "mxcfb";
             memcpy(screeninfo->id, fb_id, sizeof(fb_id));
             return 0;
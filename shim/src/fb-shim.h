@@ -1,5 +1,13 @@
 #pragma once
+#include <sys/types.h>
 
 int fbShimOpen(const char *file);
 int fbShimClose(int fd);
 int fbShimIoctl(int fd, unsigned long request, char *ptr);
+void fbShimSetVisibility(int state);
+void fbShimFrameCredit();
+void fbShimConfigure();
+void fbShimReconfigured();
+ssize_t fbShimWrite(int fd, const void *buffer, size_t count);
+ssize_t fbShimPwrite(int fd, const void *buffer, size_t count, off64_t offset);
+off64_t fbShimLseek(int fd, off64_t offset, int whence);
@@ -0,0 +1,13 @@
+#include "fdset.h"
+
+std::atomic<uint64_t> shimOwnedFDs[SHIM_FDSET_SIZE / 64];
+
+void markShimFD(int fd) {
+    if(fd < 0 || fd >= SHIM_FDSET_SIZE) return;
+    shimOwnedFDs[fd / 64].fetch_or(1ULL << (fd % 64), std::memory_order_relaxed);
+}
+
+void unmarkShimFD(int fd) {
+    if(fd < 0 || fd >= SHIM_FDSET_SIZE) return;
+    shimOwnedFDs[fd / 64].fetch_and(~(1ULL << (fd % 64)), std::memory_order_relaxed);
+}
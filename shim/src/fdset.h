@@ -0,0 +1,20 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+// Bitmap of the file descriptors the shim hands out (the fake framebuffer and the input
+// queues). close() and ioctl() check it first, so that calls on every other descriptor
+// go straight to libc.
+#define SHIM_FDSET_SIZE 4096
+
+extern std::atomic<uint64_t> shimOwnedFDs[SHIM_FDSET_SIZE / 64];
+
+void markShimFD(int fd);
+void unmarkShimFD(int fd);
+
+inline bool isShimFD(int fd) {
+    if(fd < 0) return false;
+    // Descriptors past the end of the bitmap can't be tracked - let the slow path decide.
+    if(fd >= SHIM_FDSET_SIZE) return true;
+    return shimOwnedFDs[fd / 64].load(std::memory_order_relaxed) & (1ULL << (fd % 64));
+}
@@ -3,6 +3,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <dlfcn.h>
+#include "shim.h"
 
 fileident_t getFileIdentity(int fd) {
     struct stat stat;
@@ -26,8 +27,7 @@ fileident_t getFileIdentity(int fd) {
 }
 
 fileident_t getFileIdentityFromPath(const char *path) {
-    static int (*_open)(const char *, int, mode_t) = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open");
-    int fd = _open(path, O_RDONLY, 0);
+    int fd = REAL(open)(path, O_RDONLY, 0);
     fileident_t ident = getFileIdentity(fd);
     if(fd != -1) close(fd);
     return ident;
@@ -1,6 +1,11 @@
 #include <sys/select.h>
+#include <sys/eventfd.h>
 #include "input-shim.h"
 #include "shim.h"
+#include "connection.h"
+#include "fb-shim.h"
+#include "fdset.h"
+#include "device-profiles.h"
 #include <algorithm>
 #include <deque>
 #include <map>
@@ -12,6 +17,7 @@
 #include <linux/input.h>
 #include <vector>
 #include <set>
+#include <mutex>
 #include <thread>
 #include <unistd.h>
 #include <dlfcn.h>
@@ -22,32 +28,7 @@
 
 #define DEV_NULL "/dev/null"
 
-#define RM1_MAX_DIGI_X 20967
-#define RM1_MAX_DIGI_Y 15725
-#define RM1_MAX_TOUCH_X 767
-#define RM1_MAX_TOUCH_Y 1023
-#define RM1_MAX_PRESSURE 4095
-
-#define RM1_MAX_TOUCH_MAJOR 255
-#define RM1_MAX_TOUCH_MINOR 255
-#define RM1_MIN_ORIENTATION -127
-#define RM1_MAX_ORIENTATION  127
-
-#define RMPP_MAX_TOUCH_X 2064
-#define RMPP_MAX_TOUCH_Y 2832
-#define RMPP_MAX_PRESSURE 4096
-#define RMPP_MAX_DIGI_X 11180
-#define RMPP_MAX_DIGI_Y 15340
-
-
-#define RMPPM_MAX_TOUCH_X 1248
-#define RMPPM_MAX_TOUCH_Y 2208
-#define RMPPM_MAX_PRESSURE 4096
-#define RMPPM_MAX_DIGI_X 6760
-#define RMPPM_MAX_DIGI_Y 11960
-
 extern qtfb::ClientConnection *clientConnection;
-extern int shimInputType;
 extern std::set<fileident_t> *identDigitizer, *identTouchScreen, *identButtons;
 
 struct TouchSlotState {
@@ -66,25 +47,33 @@ static struct {
     int pipeRead, pipeWrite;
 } nullPipe;
 
-static struct input_event evt(unsigned short type, unsigned short code, int value) {
+// All the events making up one SYN_REPORT frame. Like the kernel does, they share a timestamp,
+// and get delivered to every matching queue with a single write().
+#define MAX_EVENTS_PER_FRAME 16
+struct EventFrame {
+    int queueType = 0;
+    int count = 0;
+    struct input_event events[MAX_EVENTS_PER_FRAME];
 #if (__BITS_PER_LONG != 32)
     timeval time;
-    gettimeofday(&time, NULL);
-    struct input_event x = {
-        .time = time,
-        .type = type,
-        .code = code,
-        .value = value,
-    };
-#else
-    struct input_event x = {
-        .type = type,
-        .code = code,
-        .value = value,
-    };
+
+    EventFrame() {
+        gettimeofday(&time, NULL);
+    }
 #endif
-    return x;
-}
+
+    void push(int queueType, unsigned short type, unsigned short code, int value) {
+        this->queueType = queueType;
+        struct input_event &event = events[count++];
+        memset(&event, 0, sizeof(event));
+#if (__BITS_PER_LONG != 32)
+        event.time = time;
+#endif
+        event.type = type;
+        event.code = code;
+        event.value = value;
+    }
+};
 
 static int mapKey(int x) {
     switch(x) {
@@ -95,87 +84,159 @@ static int mapKey(int x) {
     return 0;
 }
 
-static void pushToAll(int queueType, struct input_event evt) {
+// Guards the event queue maps - the polling thread delivers into them while the app opens
+// and closes queues.
+static std::mutex eventQueueMutex;
+
+void inputShimLockQueues() {
+    eventQueueMutex.lock();
+}
+
+void inputShimUnlockQueues() {
+    eventQueueMutex.unlock();
+}
+
+static void deliverFrame(const EventFrame &frame) {
+    if(frame.count == 0) return;
+    size_t size = frame.count * sizeof(struct input_event);
+    std::lock_guard<std::mutex> lock(eventQueueMutex);
     struct PIDEventQueue *current = pidEventQueue;
     while(current != NULL) {
         for(auto &ref : current->eventQueue) {
-            if(ref.second.queueType == queueType) {
-                write(ref.second.queueWrite, &evt, sizeof(evt));
+            if(ref.second.queueType == frame.queueType) {
+                // Less than PIPE_BUF, so readers never see a partial frame. The write end
+                // is non-blocking: like evdev, frames are dropped if the app doesn't read.
+                write(ref.second.queueWrite, frame.events, size);
             }
         }
         current = current->next;
     }
 }
 
-static void pollInputUpdates() {
+// Fixed-point (16.16) form of an AxisProfile, for the framebuffer's current size.
+struct AxisTransform {
+    int source = 0;
+    int64_t scale = 0;
+    int32_t offset = 0;
+    int32_t direction = 1;
+
+    inline int apply(const int *values) const {
+        return offset + direction * (int) ((values[source] * scale) >> 16);
+    }
+
+    void configure(const AxisProfile &axis, int width, int height) {
+        int ranges[3] = { width, height, 100 };
+        int range = ranges[axis.range] > 0 ? ranges[axis.range] : 1;
+        source = axis.source;
+        scale = (((int64_t) axis.maximum << 16) + range / 2) / range;
+        offset = axis.inverted ? axis.maximum : 0;
+        direction = axis.inverted ? -1 : 1;
+    }
+};
+
+static const DeviceProfile *activeProfile = &deviceProfiles[0];
+static struct {
+    AxisTransform touchX, touchY, penX, penY, pressure;
+} activeTransform;
+
+// What each kind of queue reports through EVIOCGABS, indexed by queue type and axis code.
+static struct input_absinfo absInfo[QUEUE_BUTTONS + 1][ABS_CNT];
+static bool absInfoKnown[QUEUE_BUTTONS + 1][ABS_CNT];
+static const InputDeviceProfile *queueDevices[QUEUE_BUTTONS + 1];
+
+static void updateInputTransform() {
+    int width = clientConnection ? clientConnection->width() : 0;
+    int height = clientConnection ? clientConnection->height() : 0;
+    activeTransform.touchX.configure(activeProfile->touchX, width, height);
+    activeTransform.touchY.configure(activeProfile->touchY, width, height);
+    activeTransform.penX.configure(activeProfile->penX, width, height);
+    activeTransform.penY.configure(activeProfile->penY, width, height);
+    activeTransform.pressure.configure(activeProfile->pressure, width, height);
+}
+
+static void setAbsInfo(int queueType, int code, int minimum, int maximum, int fuzz) {
+    struct input_absinfo &info = absInfo[queueType][code];
+    memset(&info, 0, sizeof(info));
+    info.minimum = minimum;
+    info.maximum = maximum;
+    info.fuzz = fuzz;
+    absInfoKnown[queueType][code] = true;
+}
+
+void inputShimSelectProfile(int profile) {
+    if(profile < 0 || profile >= DEVICE_PROFILE_COUNT) profile = 0;
+    activeProfile = &deviceProfiles[profile];
+
+    memset(absInfoKnown, 0, sizeof(absInfoKnown));
+    setAbsInfo(QUEUE_TOUCH, ABS_MT_POSITION_X, 0, activeProfile->touchX.maximum, 100);
+    setAbsInfo(QUEUE_TOUCH, ABS_MT_POSITION_Y, 0, activeProfile->touchY.maximum, 100);
+    setAbsInfo(QUEUE_TOUCH, ABS_MT_ORIENTATION, activeProfile->minOrientation, activeProfile->maxOrientation, 0);
+    setAbsInfo(QUEUE_TOUCH, ABS_MT_SLOT, 0, activeProfile->maxTouchSlot, 0);
+    setAbsInfo(QUEUE_PEN, ABS_X, 0, activeProfile->penX.maximum, 0);
+    setAbsInfo(QUEUE_PEN, ABS_Y, 0, activeProfile->penY.maximum, 0);
+
+    queueDevices[0] = &activeProfile->buttons;
+    queueDevices[QUEUE_TOUCH] = &activeProfile->touchScreen;
+    queueDevices[QUEUE_PEN] = &activeProfile->digitizer;
+    queueDevices[QUEUE_BUTTONS] = &activeProfile->buttons;
+
+    updateInputTransform();
+}
+
+// Returns false once the connection to the server is gone.
+static bool pollInputUpdates() {
     qtfb::ServerMessage message;
     if(clientConnection) {
-        if(clientConnection->pollServerPacket(message) && message.type == MESSAGE_USERINPUT) {
+        errno = 0;
+        if(!clientConnection->pollServerPacket(message)) return errno == EAGAIN || errno == EINTR;
+        if(message.type == MESSAGE_RECONFIGURE) {
+            // The surface got remapped - keep the FB shim's view of it in sync.
+            fbShimReconfigured();
+            updateInputTransform();
+            return true;
+        }
+        if(message.type == MESSAGE_VISIBILITY) {
+            fbShimSetVisibility(message.visibility.state);
+            return true;
+        }
+        if(message.type == MESSAGE_FRAME_CREDIT) {
+            fbShimFrameCredit();
+            return true;
+        }
+        if(message.type == MESSAGE_USERINPUT) {
             // Did we get a packet?
             char state_a;
 
-            int xTranslate, yTranslate, dTranslate;
-            switch(shimInputType) {
-                case SHIM_INPUT_RM1:
-                    switch(message.userInput.inputType & 0xF0) {
-                        case INPUT_TOUCH_PRESS:
-                            xTranslate = RM1_MAX_TOUCH_X - ((message.userInput.x * RM1_MAX_TOUCH_X) / (int) clientConnection->width());
-                            yTranslate = RM1_MAX_TOUCH_Y - ((message.userInput.y * RM1_MAX_TOUCH_Y) / (int) clientConnection->height());
-                            break;
-                        case INPUT_PEN_PRESS:
-                            xTranslate = RM1_MAX_DIGI_X - ((message.userInput.y * RM1_MAX_DIGI_X) / clientConnection->height());
-                            yTranslate = (message.userInput.x * RM1_MAX_DIGI_Y) / clientConnection->width();
-                            dTranslate = (message.userInput.d * 4096) / 100;
-                            break;
-                    }
-                    break;
-                case SHIM_INPUT_RMPP:
-                    switch(message.userInput.inputType & 0xF0) {
-                        case INPUT_TOUCH_PRESS:
-                            xTranslate = ((message.userInput.x * RMPP_MAX_TOUCH_X) / (int) clientConnection->width());
-                            yTranslate = ((message.userInput.y * RMPP_MAX_TOUCH_Y) / (int) clientConnection->height());
-                            break;
-                        case INPUT_PEN_PRESS:
-                            xTranslate = (message.userInput.x * RMPP_MAX_DIGI_X) / clientConnection->width();
-                            yTranslate = (message.userInput.y * RMPP_MAX_DIGI_Y) / clientConnection->height();
-                            dTranslate = (message.userInput.d * 255) / 100;
-                            break;
-                    }
-                    break;
-                case SHIM_INPUT_RMPPM:
-                    switch(message.userInput.inputType & 0xF0) {
-                        case INPUT_TOUCH_PRESS:
-                            xTranslate = ((message.userInput.x * RMPPM_MAX_TOUCH_X) / (int) clientConnection->width());
-                            yTranslate = ((message.userInput.y * RMPPM_MAX_TOUCH_Y) / (int) clientConnection->height());
-                            break;
-                        case INPUT_PEN_PRESS:
-                            xTranslate = (message.userInput.x * RMPPM_MAX_DIGI_X) / clientConnection->width();
-                            yTranslate = (message.userInput.y * RMPPM_MAX_DIGI_Y) / clientConnection->height();
-                            dTranslate = (message.userInput.d * 255) / 100;
-                            break;
-                    }
-                    break;
+            int source[3] = { message.userInput.x, message.userInput.y, message.userInput.d };
+            int xTranslate, yTranslate, dTranslate = activeTransform.pressure.apply(source);
+            if((message.userInput.inputType & 0xF0) == INPUT_TOUCH_PRESS) {
+                xTranslate = activeTransform.touchX.apply(source);
+                yTranslate = activeTransform.touchY.apply(source);
+            } else {
+                xTranslate = activeTransform.penX.apply(source);
+                yTranslate = activeTransform.penY.apply(source);
             }
 
+            EventFrame frame;
             CERR << "[QTFB SHIM INPUT]: " << (int) message.userInput.inputType << ", " << message.userInput.x << ", " << message.userInput.y << " (Translated to " << xTranslate << ", " << yTranslate << ")" << std::endl;
             switch(message.userInput.inputType) {
                 case INPUT_TOUCH_PRESS:
                     state_a = 1;
-                    pushToAll(QUEUE_TOUCH, evt(EV_ABS, ABS_MT_SLOT, 1));
-                    pushToAll(QUEUE_TOUCH, evt(EV_ABS, ABS_MT_TRACKING_ID, 50));
+                    frame.push(QUEUE_TOUCH, EV_ABS, ABS_MT_SLOT, 1);
+                    frame.push(QUEUE_TOUCH, EV_ABS, ABS_MT_TRACKING_ID, 50);
                     goto sendpos;
                 case INPUT_TOUCH_RELEASE:
                     state_a = 0;
-                    pushToAll(QUEUE_TOUCH, evt(EV_ABS, ABS_MT_TRACKING_ID, -1));
+                    frame.push(QUEUE_TOUCH, EV_ABS, ABS_MT_TRACKING_ID, -1);
                     sendpos:
                     if(state_a != 0) {
-                        pushToAll(QUEUE_TOUCH, evt(EV_ABS, ABS_MT_POSITION_X, xTranslate));
-                        pushToAll(QUEUE_TOUCH, evt(EV_ABS, ABS_MT_POSITION_Y, yTranslate));
+                        frame.push(QUEUE_TOUCH, EV_ABS, ABS_MT_POSITION_X, xTranslate);
+                        frame.push(QUEUE_TOUCH, EV_ABS, ABS_MT_POSITION_Y, yTranslate);
                     }
                     if(state_a == 1 || state_a == 0) {
-                        pushToAll(QUEUE_TOUCH, evt(EV_KEY, BTN_TOUCH, state_a));
+                        frame.push(QUEUE_TOUCH, EV_KEY, BTN_TOUCH, state_a);
                     }
-                    pushToAll(QUEUE_TOUCH, evt(EV_SYN, SYN_REPORT, 0));
+                    frame.push(QUEUE_TOUCH, EV_SYN, SYN_REPORT, 0);
                     break;
                 case INPUT_TOUCH_UPDATE:{
                     state_a = 2;
@@ -186,51 +247,88 @@ static void pollInputUpdates() {
 
 
                 case INPUT_PEN_PRESS:
-                    pushToAll(QUEUE_PEN, evt(EV_KEY, BTN_TOOL_PEN, 1));
-                    pushToAll(QUEUE_PEN, evt(EV_KEY, BTN_TOUCH, 1));
+                    frame.push(QUEUE_PEN, EV_KEY, BTN_TOOL_PEN, 1);
+                    frame.push(QUEUE_PEN, EV_KEY, BTN_TOUCH, 1);
                     goto pen_fall;
                 case INPUT_PEN_RELEASE:
-                    pushToAll(QUEUE_PEN, evt(EV_KEY, BTN_TOOL_PEN, 1));
-                    pushToAll(QUEUE_PEN, evt(EV_KEY, BTN_TOUCH, 0));
+                    frame.push(QUEUE_PEN, EV_KEY, BTN_TOOL_PEN, 1);
+                    frame.push(QUEUE_PEN, EV_KEY, BTN_TOUCH, 0);
                     goto pen_fall;
                 case INPUT_PEN_UPDATE:
-                    pushToAll(QUEUE_PEN, evt(EV_KEY, BTN_TOOL_PEN, 1));
+                    frame.push(QUEUE_PEN, EV_KEY, BTN_TOOL_PEN, 1);
                 pen_fall:
-                    pushToAll(QUEUE_PEN, evt(EV_ABS, ABS_X, xTranslate));
-                    pushToAll(QUEUE_PEN, evt(EV_ABS, ABS_Y, yTranslate));
-                    pushToAll(QUEUE_PEN, evt(EV_ABS, ABS_PRESSURE, dTranslate));
-                    pushToAll(QUEUE_PEN, evt(EV_SYN, SYN_REPORT, 0));
+                    frame.push(QUEUE_PEN, EV_ABS, ABS_X, xTranslate);
+                    frame.push(QUEUE_PEN, EV_ABS, ABS_Y, yTranslate);
+                    frame.push(QUEUE_PEN, EV_ABS, ABS_PRESSURE, dTranslate);
+                    frame.push(QUEUE_PEN, EV_SYN, SYN_REPORT, 0);
                     break;
                 case INPUT_BTN_PRESS:
-                    pushToAll(QUEUE_BUTTONS, evt(EV_KEY, mapKey(message.userInput.x), 1));
-                    pushToAll(QUEUE_BUTTONS, evt(EV_SYN, SYN_REPORT, 0));
+                    frame.push(QUEUE_BUTTONS, EV_KEY, mapKey(message.userInput.x), 1);
+                    frame.push(QUEUE_BUTTONS, EV_SYN, SYN_REPORT, 0);
                     break;
                 case INPUT_BTN_RELEASE:
-                    pushToAll(QUEUE_BUTTONS, evt(EV_KEY, mapKey(message.userInput.x), 0));
-                    pushToAll(QUEUE_BUTTONS, evt(EV_SYN, SYN_REPORT, 0));
+                    frame.push(QUEUE_BUTTONS, EV_KEY, mapKey(message.userInput.x), 0);
+                    frame.push(QUEUE_BUTTONS, EV_SYN, SYN_REPORT, 0);
                     break;
                 default: break;
             }
+            deliverFrame(frame);
         }
     }
+    return true;
 }
 
 static std::thread pollingThread;
-static bool pollingThreadRunning;
+// Written to in order to stop the polling thread.
+static int pollingThreadWakeup = -1;
+// Only the process which started the thread may stop it - forked children share the
+// eventfd, but not the thread.
+static int pollingThreadOwnerPID = 0;
+
+static void pollingThreadMain() {
+    struct pollfd fds[2] = {
+        { .fd = clientConnection->socketFD(), .events = POLLIN },
+        { .fd = pollingThreadWakeup, .events = POLLIN },
+    };
+    for(;;) {
+        if(poll(fds, 2, -1) == -1) {
+            if(errno == EINTR) continue;
+            CERR << "Polling thread failed to poll: " << errno << std::endl;
+            return;
+        }
+        if(fds[1].revents & POLLIN) {
+            return;
+        }
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if(!pollInputUpdates()) {
+                CERR << "Connection to the server lost. Stopping input polling." << std::endl;
+                return;
+            }
+        }
+    }
+}
 
 static void killPollingThread() {
-    pollingThreadRunning = false;
-    // pollingThreadRunning.join();
+    if(pollingThreadOwnerPID != getpid() || !pollingThread.joinable()) return;
+    uint64_t value = 1;
+    write(pollingThreadWakeup, &value, sizeof(value));
+    pollingThread.join();
+    close(pollingThreadWakeup);
+    pollingThreadWakeup = -1;
 }
 
 void startPollingThread() {
+    if(!clientConnection) return;
+    // Now that the framebuffer's size is known.
+    updateInputTransform();
     pipe((int*) &nullPipe);
-    pollingThreadRunning = true;
-    pollingThread = std::thread([&]() {
-        while(pollingThreadRunning) {
-            pollInputUpdates();
-        }
-    });
+    pollingThreadWakeup = eventfd(0, EFD_CLOEXEC);
+    if(pollingThreadWakeup == -1) {
+        CERR << "Failed to create the polling thread's eventfd: " << errno << std::endl;
+        return;
+    }
+    pollingThreadOwnerPID = getpid();
+    pollingThread = std::thread(pollingThreadMain);
 
     atexit(killPollingThread);
 }
@@ -241,30 +339,42 @@ static int createInEventMap(int type, int flags) {
         CERR << "Failed to create pipe: " << errno << std::endl;
         abort();
     }
+    // The polling thread writes with eventQueueMutex held, so it must never block on a full pipe.
+    // Once the app falls behind by a pipe's worth (64KiB, a few thousand events), whole SYN frames are
+    // dropped until it catches up. The real evdev device drops events the same way (SYN_DROPPED).
+    fcntl(_pipe[1], F_SETFL, fcntl(_pipe[1], F_GETFL) | O_NONBLOCK);
     CERR << "Create evqueue pipe r:" << _pipe[0] << ", w:" << _pipe[1] << std::endl;
+    std::lock_guard<std::mutex> lock(eventQueueMutex);
     pidEventQueue->eventQueue.try_emplace(_pipe[0], type, _pipe[0], _pipe[1]);
+    markShimFD(_pipe[0]);
     return _pipe[0];
 }
 
 int inputShimOpen(fileident_t identity, int flags, mode_t mode) {
+#ifdef DEBUG
     CERR << "Check " << std::hex << identity << std::dec << std::endl;
     #define e(n, x) CERR << n << std::endl; for(auto a : x) CERR << "- " << a << std::endl
     e("dig", *identDigitizer);
     e("tch", *identTouchScreen);
     e("btn", *identButtons);
     #undef e
+#endif
+    if(identity == -1ULL) return INTERNAL_SHIM_NOT_APPLICABLE;
     if(identDigitizer->find(identity) != identDigitizer->end()) {
+        ensureShimConnected();
         int fd = createInEventMap(QUEUE_PEN, flags);
         CERR << "Open digitizer " << fd << std::endl;
         return fd;
     }
 
     if(identTouchScreen->find(identity) != identTouchScreen->end()) {
+        ensureShimConnected();
         int fd = createInEventMap(QUEUE_TOUCH, flags);
         CERR << "Open touchscreen " << fd << std::endl;
         return fd;
     }
     if(identButtons->find(identity) != identButtons->end()) {
+        ensureShimConnected();
         int fd = createInEventMap(QUEUE_BUTTONS, flags);
         CERR << "Open buttons " << fd << std::endl;
         return fd;
@@ -277,236 +387,68 @@ int inputShimClose(int fd, int (*realClose)(int)) {
     CERR << "Shim close " << fd << std::endl;
     // Only close in own event queue.
     // TODO: Should it then be migrated downwards to children??
+    std::lock_guard<std::mutex> lock(eventQueueMutex);
     auto position = pidEventQueue->eventQueue.find(fd);
     if(position != pidEventQueue->eventQueue.end()) {
         realClose(position->second.queueRead);
         realClose(position->second.queueWrite);
         pidEventQueue->eventQueue.erase(position);
+        unmarkShimFD(fd);
         return 0;
     }
 
     return INTERNAL_SHIM_NOT_APPLICABLE;
 }
 
-static int fakeOrOverrideAbsInfo(
-    int fd,
-    unsigned long request,
-    char *ptr,
-    int (*realIoctl)(int, unsigned long, char*),
-    int minVal,
-    int maxVal,
-    int fuzzVal,
-    int flatVal,
-    int resolutionVal)
-{
-    // Disregard original return value.
-    struct input_absinfo *absinfo = reinterpret_cast<struct input_absinfo*>(ptr);
-    std::memset(absinfo, 0, sizeof(absinfo));
-
-    // realIoctl(fd, request, ptr);
-    absinfo->minimum    = minVal;
-    absinfo->maximum    = maxVal;
-    absinfo->fuzz       = fuzzVal;
-    absinfo->flat       = flatVal;
-    absinfo->resolution = resolutionVal;
+template<size_t Count> static int answerCapabilities(char *ptr, unsigned size, const CapabilityBits<Count> &capabilities) {
+    // The caller's buffer may be shorter than the full bitmap.
+    unsigned long *bits = (unsigned long *) ptr;
+    size_t longs = std::min<size_t>(size / sizeof(unsigned long), PROFILE_NLONGS(Count));
+    for(size_t i = 0; i < longs; i++) {
+        bits[i] |= capabilities.bits[i];
+    }
     return 0;
 }
 
-#define BITS_PER_LONG (sizeof(long) * 8)
-#define NBITS(x) ((((x)-1)/BITS_PER_LONG)+1)
-#define OFF(x)  ((x)%BITS_PER_LONG)
-#define BIT(x)  (1ULL<<OFF(x))
-#define LONG(x) ((x)/BITS_PER_LONG)
-#define SETBIT(bit, array)  (array[LONG(bit)] |= BIT(bit))
-
-#define IS_MATCHING_IOCTL(dir, type, nr) ((request & ~(_IOC_SIZEMASK << _IOC_SIZESHIFT)) == (_IOC(dir, type, nr, 0)))
-#define IS_MATCHING_IOCTL_S(dir, type, nr, size) (request == (_IOC(dir, type, nr, size)))
-
-#define CASE_FAMILY(name, device) case SHIM_INPUT_ ## device: return device ## _MAX_ ## name;
-#define MAXFUNC(name) int getMaxEventValueFor ## name() { \
-    switch(shimInputType) {                               \
-        CASE_FAMILY(name, RM1)                            \
-        CASE_FAMILY(name, RMPP)                           \
-        CASE_FAMILY(name, RMPPM)                          \
-    }                                                     \
-    return -1;                                            \
-}
-MAXFUNC(DIGI_X)
-MAXFUNC(DIGI_Y)
-MAXFUNC(TOUCH_X)
-MAXFUNC(TOUCH_Y)
-
 int inputShimIoctl(int fd, unsigned long request, char *ptr, int (*realIoctl)(int fd, unsigned long request, char *ptr)) {
-    PerFDEventQueue *ref = NULL;
-    PIDEventQueue *current = pidEventQueue;
-    while(current) {
-        auto position = current->eventQueue.find(fd);
-        if(position != current->eventQueue.end()) {
-            ref = &current->eventQueue.at(fd);
-        }
+    int queueType = 0;
+    {
+        std::lock_guard<std::mutex> lock(eventQueueMutex);
+        PIDEventQueue *current = pidEventQueue;
+        while(current) {
+            auto position = current->eventQueue.find(fd);
+            if(position != current->eventQueue.end()) {
+                queueType = position->second.queueType;
+            }
 
-        current = current->next;
+            current = current->next;
+        }
     }
-    if(!ref) return INTERNAL_SHIM_NOT_APPLICABLE;
-    int ioctlInternalSize = _IOC_SIZE(request);
+    if(!queueType) return INTERNAL_SHIM_NOT_APPLICABLE;
 
     unsigned cmdDir  = _IOC_DIR(request);
     unsigned cmdType = _IOC_TYPE(request);
     unsigned cmdNr   = _IOC_NR(request);
     unsigned cmdSize = _IOC_SIZE(request);
 
-    if (ref->queueType == QUEUE_TOUCH) {
-        CERR << "Touchscreen IOCTL: " << request << std::endl;
-        int status;
-
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_MT_POSITION_X, sizeof(input_absinfo))) {
-            return fakeOrOverrideAbsInfo(fd, request, ptr, realIoctl,
-                                        0, getMaxEventValueForTOUCH_X(),
-                                        100, 0, 0);
-        }
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_MT_POSITION_Y, sizeof(input_absinfo))) {
-            return fakeOrOverrideAbsInfo(fd, request, ptr, realIoctl,
-                                        0, getMaxEventValueForTOUCH_Y(),
-                                        100, 0, 0);
-        }
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_MT_ORIENTATION, sizeof(input_absinfo))) {
-            struct input_absinfo *absinfo = reinterpret_cast<struct input_absinfo*>(ptr);
-            std::memset(absinfo, 0, sizeof(absinfo));
-            // int status = realIoctl(fd, request, ptr);
-            absinfo->minimum = RM1_MIN_ORIENTATION;
-            absinfo->maximum = RM1_MAX_ORIENTATION;
-        }
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_MT_SLOT, sizeof(input_absinfo))) {
-            struct input_absinfo *absinfo = reinterpret_cast<struct input_absinfo*>(ptr);
-            std::memset(absinfo, 0, sizeof(absinfo));
-            // int status = realIoctl(fd, request, ptr);
-            absinfo->maximum = 3;
-        }
-
-        if(IS_MATCHING_IOCTL(_IOC_READ, 'E', 0x6)) {
-            // Get Name
-            CERR << "Get device name" << std::endl;
-            strncpy(ptr, "cyttsp5_mt", cmdSize);
-        }
-
-        // pretend like we support everything the RM1 supports
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == 0x20) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-            SETBIT(EV_ABS, bits);
-            SETBIT(EV_REL, bits);
-        }
-
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == (0x20 + EV_ABS)) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-
-            SETBIT(ABS_MT_POSITION_X, bits);
-            SETBIT(ABS_MT_POSITION_Y, bits);
-            SETBIT(ABS_MT_PRESSURE, bits);
-            SETBIT(ABS_MT_TOUCH_MAJOR, bits);
-            SETBIT(ABS_MT_TOUCH_MINOR, bits);
-            SETBIT(ABS_MT_ORIENTATION, bits);
-            SETBIT(ABS_MT_SLOT, bits);
-            SETBIT(ABS_MT_TOOL_TYPE, bits);
-            SETBIT(ABS_MT_TRACKING_ID, bits);
-        }
-    }
-
-    if(ref->queueType == QUEUE_PEN) {
-        CERR << "Digitizer IOCTL: " << request << std::endl;
-
-        int status;
-
-        if(IS_MATCHING_IOCTL(_IOC_READ, 'E', 0x6)) {
-            // Get Name
-            CERR << "Get device name" << std::endl;
-            strncpy(ptr, "Wacom I2C Digitizer", cmdSize);
-        }
-
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_X, sizeof(input_absinfo))) {
-            return fakeOrOverrideAbsInfo(fd, request, ptr, realIoctl,
-                                        0, getMaxEventValueForDIGI_X(),
-                                        0, 0, 0);
-        }
-        if (IS_MATCHING_IOCTL_S(_IOC_READ, 'E', 0x40 + ABS_Y, sizeof(input_absinfo))) {
-            return fakeOrOverrideAbsInfo(fd, request, ptr, realIoctl,
-                                        0, getMaxEventValueForDIGI_Y(),
-                                        0, 0, 0);
-        }
-
-
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == 0x20) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-            SETBIT(EV_ABS, bits);
-            SETBIT(EV_KEY, bits);
-            SETBIT(EV_SYN, bits);
-        }
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == (0x20 + EV_ABS)) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-
-            SETBIT(ABS_X, bits);
-            SETBIT(ABS_Y, bits);
-            SETBIT(ABS_PRESSURE, bits);
-            SETBIT(ABS_DISTANCE, bits);
-            SETBIT(ABS_TILT_X, bits);
-            SETBIT(ABS_TILT_Y, bits);
-        }
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == (0x20 + EV_KEY)) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
+    const InputDeviceProfile &device = *queueDevices[queueType];
+    CERR << device.name << " IOCTL: " << request << std::endl;
+    if(cmdDir != _IOC_READ || cmdType != 'E') return 0;
 
-            SETBIT(BTN_TOOL_PEN, bits);
-            SETBIT(BTN_TOOL_RUBBER, bits);
-            SETBIT(BTN_TOUCH, bits);
-            SETBIT(BTN_STYLUS, bits);
-            SETBIT(BTN_STYLUS2, bits);
-        }
+    if(cmdNr == 0x06) {
+        // Get Name
+        strncpy(ptr, device.name, cmdSize);
+        return 0;
     }
-
-    if (ref->queueType == QUEUE_BUTTONS) {
-        CERR << "Buttons IOCTL: " << request << std::endl;
-        int status;
-
-        if(IS_MATCHING_IOCTL(_IOC_READ, 'E', 0x6)) {
-            // Get Name
-            strncpy(ptr, "gpio_buttons", cmdSize);
-        }
-
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == 0x20) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-            SETBIT(EV_SYN, bits);
-            SETBIT(EV_KEY, bits);
-        }
-
-        if (cmdDir == _IOC_READ && cmdType == 'E' && cmdNr == (0x20 + EV_KEY)) {
-            // int status = realIoctl(fd, request, ptr);
-            // if (status < 0) return status;
-
-            unsigned long *bits = (unsigned long*) ptr;
-
-            SETBIT(KEY_HOME, bits);
-            SETBIT(KEY_LEFT, bits);
-            SETBIT(KEY_RIGHT, bits);
-            SETBIT(KEY_WAKEUP, bits);
-            SETBIT(KEY_POWER, bits);
+    if(cmdNr >= 0x40 && cmdNr < 0x40 + ABS_CNT && cmdSize == sizeof(struct input_absinfo)) {
+        if(absInfoKnown[queueType][cmdNr - 0x40]) {
+            memcpy(ptr, &absInfo[queueType][cmdNr - 0x40], sizeof(struct input_absinfo));
         }
+        return 0;
     }
+    if(cmdNr == 0x20) return answerCapabilities(ptr, cmdSize, device.events);
+    if(cmdNr == 0x20 + EV_ABS) return answerCapabilities(ptr, cmdSize, device.abs);
+    if(cmdNr == 0x20 + EV_KEY) return answerCapabilities(ptr, cmdSize, device.keys);
 
     return 0;
 }
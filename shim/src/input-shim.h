@@ -4,6 +4,7 @@
 #include <map>
 #include "fileident.h"
 
+// Indices into deviceProfiles (device-profiles.h)
 #define SHIM_INPUT_RM1 0
 #define SHIM_INPUT_RMPP 1
 #define SHIM_INPUT_RMPPM 2
@@ -12,6 +13,9 @@ int inputShimOpen(fileident_t ident, int flags, mode_t mode);
 int inputShimClose(int fd, int (*realClose)(int fd));
 int inputShimIoctl(int fd, unsigned long request, char *ptr, int (*realFopen)(int fd, unsigned long request, char *ptr));
 void startPollingThread();
+void inputShimSelectProfile(int profile);
+void inputShimLockQueues();
+void inputShimUnlockQueues();
 
 
 struct PerFDEventQueue {
@@ -11,20 +11,17 @@
 #include "input-shim.h"
 #include <sys/mman.h>
 #include <asm/fcntl.h>
+#include <linux/fcntl.h>
 #include "qtfb-client/common.h"
 #include "connection.h"
 #include "fileident.h"
+#include "fdset.h"
+#include "device-profiles.h"
 
 #define FAKE_MODEL "reMarkable 1.0"
 #define FILE_MODEL "/sys/devices/soc0/machine"
 
-#define RM1_TOUCHSCREEN "/dev/input/event2"
-#define RM1_BUTTONS "/dev/input/event1"
-#define RM1_DIGITIZER "/dev/input/event0"
-
-#define RMPP_TOUCHSCREEN "/dev/input/event3"
-#define RMPP_DIGITIZER "/dev/input/event2"
-
+// Same order as deviceProfiles
 #define DEV_TYPE_RM1 0
 #define DEV_TYPE_RMPP 1
 #define DEV_TYPE_RMPPM 2
@@ -35,10 +32,33 @@ bool shimFramebuffer;
 int shimInputType = SHIM_INPUT_RM1;
 std::set<fileident_t> *identDigitizer, *identTouchScreen, *identButtons;
 int realDeviceType;
+struct RealFunctions realFunctions;
+// Input device paths given through the environment. Opens of these are checked against
+// the input identities even if they live outside of /dev.
+std::set<std::string> *extraInputPaths;
+
+void resolveRealFunctions() {
+    #define RESOLVE(name, symbol) realFunctions.name = (decltype(realFunctions.name)) dlsym(RTLD_NEXT, symbol)
+    RESOLVE(open, "open");
+    RESOLVE(open64, "open64");
+    RESOLVE(openat, "openat");
+    RESOLVE(openat64, "openat64");
+    RESOLVE(close, "close");
+    RESOLVE(ioctl, "ioctl");
+    RESOLVE(ioctl_time64, "__ioctl_time64");
+    RESOLVE(fopen, "fopen");
+    RESOLVE(fopen64, "fopen64");
+    RESOLVE(write, "write");
+    RESOLVE(pwrite, "pwrite");
+    RESOLVE(pwrite64, "pwrite64");
+    RESOLVE(lseek, "lseek");
+    RESOLVE(lseek64, "lseek64");
+    #undef RESOLVE
+    realFunctions.resolved = true;
+}
 
 void readRealDeviceType() {
-    static int (*realOpen)(const char *, int, mode_t) = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open");
-    int fd = realOpen(FILE_MODEL, O_RDONLY, 0);
+    int fd = REAL(open)(FILE_MODEL, O_RDONLY, 0);
     if(fd == -1) {
         CERR << "Cannot open model file" << std::endl;
         realDeviceType = SHIM_INPUT_RM1;
@@ -73,6 +93,7 @@ static void iterStringCollectToIdentities(std::set<fileident_t> *out, const char
     std::istringstream ss(src);
     std::string temp;
     while(std::getline(ss, temp, ',')) {
+        extraInputPaths->insert(temp);
         fileident_t ident = getFileIdentityFromPath(temp.c_str());
         if(ident != 0 && ident != -1)
             out->insert(ident);
@@ -83,8 +104,10 @@ void __attribute__((constructor)) __construct () {
     if(pidEventQueue != NULL) {
         return;
     }
+    resolveRealFunctions();
     pidEventQueue = new PIDEventQueue;
-    pthread_atfork(NULL, NULL, [](){
+    pthread_atfork(inputShimLockQueues, inputShimUnlockQueues, [](){
+        inputShimUnlockQueues();
         auto previous = pidEventQueue;
         pidEventQueue = new PIDEventQueue;
         pidEventQueue->next = previous;
@@ -93,10 +116,12 @@ void __attribute__((constructor)) __construct () {
     shimModel = readEnvvarBoolean("QTFB_SHIM_MODEL", true);
     shimInput = readEnvvarBoolean("QTFB_SHIM_INPUT", true);
     shimFramebuffer = readEnvvarBoolean("QTFB_SHIM_FB", true);
+    fbShimConfigure();
 
     identDigitizer = new std::set<fileident_t>();
     identTouchScreen = new std::set<fileident_t>();
     identButtons = new std::set<fileident_t>();
+    extraInputPaths = new std::set<std::string>();
 
     readRealDeviceType();
 
@@ -162,31 +187,22 @@ void __attribute__((constructor)) __construct () {
 
     char *shimMode = getenv("QTFB_SHIM_INPUT_MODE");
     if(shimMode != NULL) {
-        if(strcmp(shimMode, "RM1") == 0) {
-            shimInputType = SHIM_INPUT_RM1;
-        } else if(strcmp(shimMode, "RMPP") == 0) {
-            shimInputType = SHIM_INPUT_RMPP;
-        } else if(strcmp(shimMode, "RMPPM") == 0) {
-            shimInputType = SHIM_INPUT_RMPPM;
-        } else if(strcmp(shimMode, "NATIVE") == 0) {
+        int profile;
+        if(strcmp(shimMode, "NATIVE") == 0) {
             shimInputType = realDeviceType;
+        } else if((profile = findDeviceProfile(shimMode)) != -1) {
+            shimInputType = profile;
         }
     }
+    inputShimSelectProfile(shimInputType);
 
     CERR << "Configured FB type to " << shimType << ", input to " << shimInputType << std::endl;
 
 
-    const char *pathDigitizer, *pathTouchScreen, *pathButtons;
-
-    if(shimInputType == SHIM_INPUT_RM1) {
-        pathDigitizer = RM1_DIGITIZER;
-        pathTouchScreen = RM1_TOUCHSCREEN;
-        pathButtons = RM1_BUTTONS;
-    } else if(shimInputType == SHIM_INPUT_RMPP || shimInputType == SHIM_INPUT_RMPPM) {
-        pathDigitizer = RMPP_DIGITIZER;
-        pathTouchScreen = RMPP_TOUCHSCREEN;
-        pathButtons = "<NONEXISTENT>";
-    }
+    const DeviceProfile &profile = deviceProfiles[shimInputType];
+    const char *pathDigitizer = profile.pathDigitizer,
+        *pathTouchScreen = profile.pathTouchScreen,
+        *pathButtons = profile.pathButtons;
 
     const char *temp;
     fileident_t ti;
@@ -211,10 +227,7 @@ void __attribute__((constructor)) __construct () {
     for(const auto e : *identButtons) {
         CERR << "Ident btn: " << e << std::endl;
     }
-    std::cerr << std::dec;
-
-    connectShim();
-    startPollingThread();
+    CERR << std::dec;
 }
 
 int spoofModelFD() {
@@ -235,8 +248,20 @@ int spoofModelFD() {
     return modelSpoofFD;
 }
 
-inline int handleOpen(const char *fileName, fileident_t identity, int flags, mode_t mode) {
-    CERR << "Open() " << fileName << ", " << std::hex << identity << std::dec << std::endl;
+// Everything the shim replaces lives under /dev or /sys. Checking that first spares
+// the fstat() and the lookups below for all other files an app opens (fonts, assets...).
+// Only plain absolute paths can be ruled out that way - relative paths, paths relative to a
+// directory fd and non-canonical ones (//dev/fb0, /tmp/../dev/fb0) always get the identity check.
+static inline bool isShimCandidatePath(int dirfd, const char *fileName) {
+    if(fileName == NULL) return false;
+    if(fileName[0] != '/' || dirfd != AT_FDCWD) return true;
+    if(strncmp(fileName, "/dev/", 5) == 0 || strncmp(fileName, "/sys/", 5) == 0) return true;
+    if(strstr(fileName, "//") != NULL || strstr(fileName, "/.") != NULL) return true;
+    return extraInputPaths != NULL && !extraInputPaths->empty() && extraInputPaths->find(fileName) != extraInputPaths->end();
+}
+
+inline int handleOpen(const char *fileName, int fd, int flags, mode_t mode) {
+    CERR << "Open() " << fileName << ", fd " << fd << std::endl;
     if(shimModel)
         if(strcmp(fileName, FILE_MODEL) == 0 && shimModel) {
             return spoofModelFD();
@@ -249,7 +274,7 @@ inline int handleOpen(const char *fileName, fileident_t identity, int flags, mod
         }
 
     if(shimInput)
-        if((status = inputShimOpen(identity, flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        if((status = inputShimOpen(getFileIdentity(fd), flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
             CERR << "[INPUT] FD ret'd: " << status << std::endl;
             return status;
         }
@@ -258,7 +283,7 @@ inline int handleOpen(const char *fileName, fileident_t identity, int flags, mod
 }
 
 extern "C" int close(int fd) {
-    static int (*realClose)(int) = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+    if(!isShimFD(fd)) return REAL(close)(fd);
 
     int status;
     if(shimFramebuffer)
@@ -266,15 +291,16 @@ extern "C" int close(int fd) {
             return status;
         }
     if(shimInput)
-        if((status = inputShimClose(fd, realClose)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        if((status = inputShimClose(fd, REAL(close))) != INTERNAL_SHIM_NOT_APPLICABLE) {
             return status;
         }
 
-    return realClose(fd);
+    return REAL(close)(fd);
 }
 
 extern "C" int ioctl(int fd, unsigned long request, char *ptr) {
-    static int (*realIoctl)(int, unsigned long, ...) = (int (*)(int, unsigned long, ...)) dlsym(RTLD_NEXT, "ioctl");
+    auto realIoctl = REAL(ioctl);
+    if(!isShimFD(fd)) return realIoctl(fd, request, ptr);
 
     int status;
     if(shimFramebuffer)
@@ -290,7 +316,8 @@ extern "C" int ioctl(int fd, unsigned long request, char *ptr) {
 }
 
 extern "C" int __ioctl_time64(int fd, unsigned long request, char *ptr) {
-    static int (*realIoctl)(int, unsigned long, ...) = (int (*)(int, unsigned long, ...)) dlsym(RTLD_NEXT, "__ioctl_time64");
+    auto realIoctl = REAL(ioctl_time64);
+    if(!isShimFD(fd)) return realIoctl(fd, request, ptr);
 
     int status;
     if(shimFramebuffer)
@@ -305,11 +332,66 @@ extern "C" int __ioctl_time64(int fd, unsigned long request, char *ptr) {
     return realIoctl(fd, request, ptr);
 }
 
+extern "C" ssize_t write(int fd, const void *buffer, size_t count) {
+    if(!isShimFD(fd) || !shimFramebuffer) return REAL(write)(fd, buffer, count);
+
+    ssize_t status;
+    if((status = fbShimWrite(fd, buffer, count)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        return status;
+    }
+
+    return REAL(write)(fd, buffer, count);
+}
+
+extern "C" ssize_t pwrite(int fd, const void *buffer, size_t count, off_t offset) {
+    if(!isShimFD(fd) || !shimFramebuffer) return REAL(pwrite)(fd, buffer, count, offset);
+
+    ssize_t status;
+    if((status = fbShimPwrite(fd, buffer, count, offset)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        return status;
+    }
+
+    return REAL(pwrite)(fd, buffer, count, offset);
+}
+
+extern "C" ssize_t pwrite64(int fd, const void *buffer, size_t count, off64_t offset) {
+    if(!isShimFD(fd) || !shimFramebuffer) return REAL(pwrite64)(fd, buffer, count, offset);
+
+    ssize_t status;
+    if((status = fbShimPwrite(fd, buffer, count, offset)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        return status;
+    }
+
+    return REAL(pwrite64)(fd, buffer, count, offset);
+}
+
+extern "C" off_t lseek(int fd, off_t offset, int whence) {
+    if(!isShimFD(fd) || !shimFramebuffer) return REAL(lseek)(fd, offset, whence);
+
+    off64_t status;
+    if((status = fbShimLseek(fd, offset, whence)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        return status;
+    }
+
+    return REAL(lseek)(fd, offset, whence);
+}
+
+extern "C" off64_t lseek64(int fd, off64_t offset, int whence) {
+    if(!isShimFD(fd) || !shimFramebuffer) return REAL(lseek64)(fd, offset, whence);
+
+    off64_t status;
+    if((status = fbShimLseek(fd, offset, whence)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+        return status;
+    }
+
+    return REAL(lseek64)(fd, offset, whence);
+}
+
 extern "C" int openat(int dirfd, const char *fileName, int flags, mode_t mode) {
-    static int (*realOpenat)(int, const char *, int, mode_t) = (int (*)(int, const char *, int, mode_t)) dlsym(RTLD_NEXT, "openat");
-    int fd = realOpenat(dirfd, fileName, flags, mode), fdo;
+    int fd = REAL(openat)(dirfd, fileName, flags, mode), fdo;
+    if(!isShimCandidatePath(dirfd, fileName)) return fd;
 
-    if((fdo = handleOpen(fileName, getFileIdentity(fd), flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if((fdo = handleOpen(fileName, fd, flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         close(fd);
         return fdo;
     }
@@ -317,10 +399,10 @@ extern "C" int openat(int dirfd, const char *fileName, int flags, mode_t mode) {
 }
 
 extern "C" int openat64(int dirfd, const char *fileName, int flags, mode_t mode) {
-    static int (*realOpenat)(int, const char *, int, mode_t) = (int (*)(int, const char *, int, mode_t)) dlsym(RTLD_NEXT, "openat64");
-    int fd = realOpenat(dirfd, fileName, flags, mode), fdo;
+    int fd = REAL(openat64)(dirfd, fileName, flags, mode), fdo;
+    if(!isShimCandidatePath(dirfd, fileName)) return fd;
 
-    if((fdo = handleOpen(fileName, getFileIdentity(fd), flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if((fdo = handleOpen(fileName, fd, flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         close(fd);
         return fdo;
     }
@@ -328,10 +410,10 @@ extern "C" int openat64(int dirfd, const char *fileName, int flags, mode_t mode)
 }
 
 extern "C" int open(const char *fileName, int flags, mode_t mode) {
-    static int (*realOpen)(const char *, int, mode_t) = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open");
-    int fd = realOpen(fileName, flags, mode), fdo;
+    int fd = REAL(open)(fileName, flags, mode), fdo;
+    if(!isShimCandidatePath(AT_FDCWD, fileName)) return fd;
 
-    if((fdo = handleOpen(fileName, getFileIdentity(fd), flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if((fdo = handleOpen(fileName, fd, flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         close(fd);
         return fdo;
     }
@@ -340,10 +422,10 @@ extern "C" int open(const char *fileName, int flags, mode_t mode) {
 }
 
 extern "C" int open64(const char *fileName, int flags, mode_t mode) {
-    static int (*realOpen64)(const char *, int, mode_t) = (int (*)(const char *, int, mode_t)) dlsym(RTLD_NEXT, "open64");
-    int fd = realOpen64(fileName, flags, mode), fdo;
+    int fd = REAL(open64)(fileName, flags, mode), fdo;
+    if(!isShimCandidatePath(AT_FDCWD, fileName)) return fd;
 
-    if((fdo = handleOpen(fileName, getFileIdentity(fd), flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if((fdo = handleOpen(fileName, fd, flags, mode)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         close(fd);
         return fdo;
     }
@@ -352,11 +434,10 @@ extern "C" int open64(const char *fileName, int flags, mode_t mode) {
 }
 
 extern "C" FILE *fopen(const char *fileName, const char *mode) {
-    static FILE *(*realFopen)(const char *, const char *) = (FILE *(*)(const char *, const char *)) dlsym(RTLD_NEXT, "fopen");
-    FILE *real = realFopen(fileName, mode);
+    FILE *real = REAL(fopen)(fileName, mode);
     int fdo;
-    if(real == NULL) return real;
-    if((fdo = handleOpen(fileName, getFileIdentity(fileno(real)), 0, 0)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if(real == NULL || !isShimCandidatePath(AT_FDCWD, fileName)) return real;
+    if((fdo = handleOpen(fileName, fileno(real), 0, 0)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         fclose(real);
         return fdopen(fdo, mode);
     }
@@ -366,11 +447,10 @@ extern "C" FILE *fopen(const char *fileName, const char *mode) {
 
 #if (__BITS_PER_LONG != 32)
 extern "C" FILE *fopen64(const char *fileName, const char *mode) {
-    static FILE *(*realFopen)(const char *, const char *) = (FILE *(*)(const char *, const char *)) dlsym(RTLD_NEXT, "fopen64");
-    FILE *real = realFopen(fileName, mode);
+    FILE *real = REAL(fopen64)(fileName, mode);
     int fdo;
-    if(real == NULL) return real;
-    if((fdo = handleOpen(fileName, getFileIdentity(fileno(real)), 0, 0)) != INTERNAL_SHIM_NOT_APPLICABLE) {
+    if(real == NULL || !isShimCandidatePath(AT_FDCWD, fileName)) return real;
+    if((fdo = handleOpen(fileName, fileno(real), 0, 0)) != INTERNAL_SHIM_NOT_APPLICABLE) {
         fclose(real);
         return fdopen(fdo, mode);
     }
@@ -1,5 +1,7 @@
 #pragma once
 #include <iostream>
+#include <stdio.h>
+#include <sys/types.h>
 #define INTERNAL_SHIM_NOT_APPLICABLE (-227008859)
 
 #ifdef DEBUG
@@ -7,3 +9,28 @@
 #else
 #define CERR if(false) std::cerr
 #endif
+
+// The libc functions the shim overrides. They're resolved once, in the constructor -
+// or on first use, if another library's constructor gets to them before ours runs.
+struct RealFunctions {
+    bool resolved;
+    int (*open)(const char *, int, mode_t);
+    int (*open64)(const char *, int, mode_t);
+    int (*openat)(int, const char *, int, mode_t);
+    int (*openat64)(int, const char *, int, mode_t);
+    int (*close)(int);
+    int (*ioctl)(int, unsigned long, ...);
+    int (*ioctl_time64)(int, unsigned long, ...);
+    FILE *(*fopen)(const char *, const char *);
+    FILE *(*fopen64)(const char *, const char *);
+    ssize_t (*write)(int, const void *, size_t);
+    ssize_t (*pwrite)(int, const void *, size_t, off_t);
+    ssize_t (*pwrite64)(int, const void *, size_t, off64_t);
+    off_t (*lseek)(int, off_t, int);
+    off64_t (*lseek64)(int, off64_t, int);
+};
+
+extern struct RealFunctions realFunctions;
+void resolveRealFunctions();
+
+#define REAL(name) ((realFunctions.resolved ? (void) 0 : resolveRealFunctions()), realFunctions.name)
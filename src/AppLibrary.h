@@ -12,6 +12,7 @@
 #include <QQuickPaintedItem>
 
 #include "library.h"
+#include "qtfb/snapshots.h"
 
 #define INTERNAL 0
 #define EXTERNAL_NOGUI 1
@@ -87,12 +88,27 @@ public:
     Q_INVOKABLE qint64 launchExternal(const QString &appID, int qtfbKey) {
         auto ref = appload::library::getExternals().find(appID);
         if(ref != appload::library::getExternals().end()) {
-            return ref->second->launch(qtfbKey);
+            qint64 pid = ref->second->launch(qtfbKey);
+            if(pid == -1) {
+                // Nothing will ever connect to that framebuffer.
+                qtfb::snapshots::unbind(qtfbKey);
+            }
+            return pid;
         }
 
+        qtfb::snapshots::unbind(qtfbKey);
         return -1;
     }
 
+    Q_INVOKABLE void preallocateFramebuffer(const QString &appID, int qtfbKey) {
+        auto ref = appload::library::getExternals().find(appID);
+        if(ref != appload::library::getExternals().end()) {
+            ref->second->preallocateFramebuffer(qtfbKey);
+            // Show the app's last frame while it's starting.
+            qtfb::snapshots::bind(qtfbKey, appID);
+        }
+    }
+
     Q_INVOKABLE void terminateExternal(qint64 pid) {
         appload::library::terminateExternal(pid);
     }
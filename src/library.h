@@ -45,6 +45,7 @@ namespace appload::library {
         QString getIconPath() const;
         QString getAppName() const;
         qint64 launch(int qtfbKey) const;
+        void preallocateFramebuffer(int qtfbKey) const;
         bool isQTFB() const;
         AspectRatio getAspectRatio() const;
 
@@ -60,6 +61,7 @@ namespace appload::library {
         QStringList args;
         std::map<QString, QString> environment;
         bool _isQTFB;
+        int qtfbFormat = -1;
         AspectRatio aspectRatio;
 
         void parseManifest();
@@ -5,6 +5,7 @@
 #include <signal.h>
 
 #include "AppLibrary.h"
+#include "qtfb/fbmanagement.h"
 
 appload::library::ExternalApplication::ExternalApplication(QString root): root(root) {
     parseManifest();
@@ -30,6 +31,50 @@ void appload::library::removeGlobalLibraryHandle(AppLoadLibrary *ptr) {
 
 
 
+enum class NativeDevice { RM2, RMPP, RMPPM };
+
+// Same detection as the shim's readRealDeviceType(), which the N_* modes depend on.
+static NativeDevice getNativeDevice() {
+    static NativeDevice device = []() {
+        QFile file("/sys/devices/soc0/machine");
+        if(!file.open(QIODevice::ReadOnly)) {
+            return NativeDevice::RM2;
+        }
+        QString machine = QString::fromUtf8(file.readAll()).toUpper();
+        if(machine.contains("FERRARI")) return NativeDevice::RMPP;
+        if(machine.contains("CHIAPPA")) return NativeDevice::RMPPM;
+        return NativeDevice::RM2;
+    }();
+    return device;
+}
+
+static int parseQTFBFormat(const QString &format) {
+    // Same names as the shim's QTFB_SHIM_MODE.
+    if(format == "RM2FB") return FBFMT_RM2FB;
+    if(format == "RGB888") return FBFMT_RMPP_RGB888;
+    if(format == "RGBA8888") return FBFMT_RMPP_RGBA8888;
+    if(format == "RGB565") return FBFMT_RMPP_RGB565;
+    if(format == "M_RGB888") return FBFMT_RMPPM_RGB888;
+    if(format == "M_RGBA8888") return FBFMT_RMPPM_RGBA8888;
+    if(format == "M_RGB565") return FBFMT_RMPPM_RGB565;
+    if(format.startsWith("N_")) {
+        NativeDevice device = getNativeDevice();
+        QString native = format.mid(2);
+        if(native == "RGB565") {
+            switch(device) {
+                case NativeDevice::RM2: return FBFMT_RM2FB;
+                case NativeDevice::RMPP: return FBFMT_RMPP_RGB565;
+                case NativeDevice::RMPPM: return FBFMT_RMPPM_RGB565;
+            }
+        }
+        // The shim refuses to start in the other native modes on an rM1 / rM2.
+        if(device == NativeDevice::RM2) return -1;
+        if(native == "RGB888") return device == NativeDevice::RMPP ? FBFMT_RMPP_RGB888 : FBFMT_RMPPM_RGB888;
+        if(native == "RGBA8888") return device == NativeDevice::RMPP ? FBFMT_RMPP_RGBA8888 : FBFMT_RMPPM_RGBA8888;
+    }
+    return -1;
+}
+
 void appload::library::ExternalApplication::parseManifest() {
     QString filePath = root + "/external.manifest.json";
     QFile file(filePath);
@@ -60,6 +105,14 @@ void appload::library::ExternalApplication::parseManifest() {
     for(auto entry = env.begin(); entry != env.end(); entry++) {
         environment[entry.key()] = entry.value().toString();
     }
+    if(_isQTFB) {
+        // Shimmed apps already state their format in the environment - and without it, the shim
+        // falls back to RM2FB.
+        bool shimmed = environment.count("LD_PRELOAD") && environment["LD_PRELOAD"].contains("qtfb-shim");
+        QString format = jsonObject.value("qtfbFormat").toString(
+            environment.count("QTFB_SHIM_MODE") ? environment["QTFB_SHIM_MODE"] : shimmed ? "RM2FB" : "");
+        qtfbFormat = parseQTFBFormat(format.toUpper());
+    }
     QString aspectRatio = jsonObject.value("aspectRatio").toString("auto").toLower();
     if(aspectRatio == "original") {
         this->aspectRatio = AspectRatio::ORIGINAL;
@@ -116,6 +169,12 @@ qint64 appload::library::ExternalApplication::launch(int qtfbKey) const {
     return pid;
 }
 
+void appload::library::ExternalApplication::preallocateFramebuffer(int qtfbKey) const {
+    if(qtfbKey != -1 && qtfbFormat != -1) {
+        qtfb::management::preallocate(qtfbKey, qtfbFormat);
+    }
+}
+
 QString appload::library::ExternalApplication::getIconPath() const {
     auto path = QFileInfo(root + "/icon.png");
     if(path.exists()) {
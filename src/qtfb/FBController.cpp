@@ -1,6 +1,18 @@
 #include "FBController.h"
 #include "fbmanagement.h"
+#include "thumbnails.h"
 #include "log.h"
+#include <QPen>
+#include <algorithm>
+#include <QTimer>
+#include <QQmlEngine>
+
+// Provisional ink the client never drew over (say, an eraser stroke) disappears after this long.
+#define INK_ECHO_EXPIRY_MS 1000
+// Upper bound on the provisional segments kept around at once.
+#define INK_ECHO_MAX_SEGMENTS 4096
+
+int FBController::maxFrameRate = 0;
 
 void FBController::setFramebufferID(int fbId){
     if(_framebufferID != fbId){
@@ -9,6 +21,10 @@ void FBController::setFramebufferID(int fbId){
     }
     _framebufferID = fbId;
     qtfb::management::registerController(fbId, QPointer(this));
+    qtfb::thumbnails::installProvider(qmlEngine(this));
+    if(_visibility != VISIBILITY_VISIBLE && fbId != -1) {
+        qtfb::management::forwardVisibility(fbId, _visibility);
+    }
 }
 
 int FBController::framebufferID() const {
@@ -32,14 +48,43 @@ FBController::~FBController(){
 void FBController::paint(QPainter *painter) {
     isMidPaint = true;
     QDEBUG << "FB Repaint triggered for " << _framebufferID << ". Status: " << _active;
-    // Do we have an SHM associated?
-    if(this->image && this->_active) {
-        // Cool. Paint it.
+    if(_visibility != VISIBILITY_VISIBLE) {
+        // Covered or hidden - don't bother drawing, but redraw everything once visible again.
+        _pendingUpdate = true;
+        isMidPaint = false;
+        return;
+    }
+    if(!placeholder.isNull()) {
+        // The client hasn't rendered anything yet.
+        if(_allowScaling) {
+            painter->drawImage(QRect(0, 0, width(), height()), placeholder, placeholder.rect());
+        } else {
+            painter->drawImage(0, 0, placeholder);
+        }
+    } else if(this->image && this->_active) {
+        // We have an SHM associated. Cool. Paint it.
         if(_allowScaling) {
             painter->drawImage(QRect(0, 0, width(), height()), *image, image->rect());
         } else {
             painter->drawImage(0, 0, *image);
         }
+        if(!_provisionalInk.empty()) {
+            painter->save();
+            painter->setRenderHint(QPainter::Antialiasing);
+            if(_allowScaling) {
+                painter->scale(width() / image->width(), height() / image->height());
+            }
+            for(const InkSegment &segment : _provisionalInk) {
+                QPen pen(_inkColor, segment.width);
+                pen.setCapStyle(Qt::RoundCap);
+                painter->setPen(pen);
+                painter->drawLine(segment.from, segment.to);
+            }
+            painter->restore();
+        }
+        if(overlay && overlayVisible) {
+            painter->drawImage(overlayTarget(), *overlay, overlay->rect());
+        }
     } else {
         /*
         QDEBUG << "Placeholder";
@@ -52,13 +97,30 @@ void FBController::paint(QPainter *painter) {
         painter->drawText(rect, "Unbound Framebuffer " + QString::number(_framebufferID), Qt::AlignCenter | Qt::AlignTop);
         */
     }
+    lastPaint.start();
+    if(_creditOwed) {
+        _creditOwed = false;
+        int key = _framebufferID;
+        QMetaObject::invokeMethod(this, [key]() {
+            qtfb::management::grantFrameCredit(key);
+        }, Qt::QueuedConnection);
+    }
     isMidPaint = false;
 }
 
 void FBController::associateSHM(QImage *image) {
     this->image = image;
     int key = _framebufferID;
-    QMetaObject::invokeMethod(this, [this, key]() {
+    QMetaObject::invokeMethod(this, [this, key, image]() {
+        this->_thumbnailStale = true;
+        if(image == nullptr) {
+            // The overlay, provisional ink and placeholder belong to the framebuffer that went away.
+            // Called from the management threads - they are only ever touched on the GUI thread.
+            this->overlay = nullptr;
+            this->overlayVisible = false;
+            this->_provisionalInk.clear();
+            this->placeholder = QImage();
+        }
         if(!qtfb::management::isControllerAssociated(key)) {
             // The framebuffer connection was terminated as we were
             // waiting for the event loop to process this request.
@@ -70,7 +132,61 @@ void FBController::associateSHM(QImage *image) {
     }, Qt::QueuedConnection);
 }
 
+void FBController::rebindSHM(QImage *image) {
+    this->image = image;
+    _thumbnailStale = true;
+    markedUpdate();
+}
+
+QRect FBController::toItemRect(const QRect &rect) const {
+    if(_allowScaling && image) {
+        return QRect(
+            rect.x() * width() / image->width(),
+            rect.y() * height() / image->height(),
+            rect.width() * width() / image->width() + 1,
+            rect.height() * height() / image->height() + 1
+        );
+    }
+    return rect;
+}
+
+QRect FBController::overlayTarget() const {
+    return toItemRect(QRect(overlayPosition, overlay->size()));
+}
+
+void FBController::setOverlay(QImage *overlay, const QPoint &position, bool visible) {
+    QRect previous = this->overlay && overlayVisible ? overlayTarget() : QRect();
+    this->overlay = overlay;
+    overlayPosition = position;
+    overlayVisible = visible;
+    if(!previous.isNull()) {
+        update(previous);
+    }
+    if(overlay && visible) {
+        update(overlayTarget());
+    }
+}
+
 void FBController::markedUpdate(const QRect &rect) {
+    if(_visibility != VISIBILITY_VISIBLE) {
+        // Nobody would see it. Repaint everything once we're back.
+        _pendingUpdate = true;
+        return;
+    }
+    if(maxFrameRate > 0 && lastPaint.isValid()) {
+        qint64 remaining = 1000 / maxFrameRate - lastPaint.elapsed();
+        if(remaining > 0) {
+            // Too early - repaint everything once the frame budget allows it.
+            if(!_deferredUpdate) {
+                _deferredUpdate = true;
+                QTimer::singleShot(remaining, this, [this]() {
+                    _deferredUpdate = false;
+                    markedUpdate();
+                });
+            }
+            return;
+        }
+    }
     isMidPaint = true;
     if(_allowScaling && image) {
         update(QRect(
@@ -84,6 +200,169 @@ void FBController::markedUpdate(const QRect &rect) {
     }
 }
 
+void FBController::clientFrameSubmitted(const QRect &rect) {
+    _creditOwed = true;
+    _receivedFrame = true;
+    dropProvisionalInk(rect);
+    if(rect.isNull()) {
+        _thumbnailStale = true;
+    } else {
+        _thumbnailDamage |= rect;
+    }
+    if(!placeholder.isNull()) {
+        // Switch to the live surface - all of it.
+        placeholder = QImage();
+        markedUpdate();
+        return;
+    }
+    markedUpdate(rect);
+}
+
+void FBController::setPlaceholder(const QImage &placeholder) {
+    if(_receivedFrame) {
+        // Too late, the app is already up.
+        return;
+    }
+    this->placeholder = placeholder;
+    markedUpdate();
+}
+
+QImage FBController::thumbnail() {
+    if(!placeholder.isNull()) {
+        // Only shown until the client's first frame, not worth keeping up to date.
+        QImage thumbnail;
+        qtfb::thumbnails::update(placeholder, thumbnail, QRect());
+        return thumbnail;
+    }
+    if(!image || !_active) {
+        return QImage();
+    }
+    if(_thumbnailStale || !_thumbnailDamage.isEmpty()) {
+        qtfb::thumbnails::update(*image, _thumbnail, _thumbnailStale ? QRect() : _thumbnailDamage);
+        _thumbnailStale = false;
+        _thumbnailDamage = QRect();
+    }
+    return _thumbnail;
+}
+
+void FBController::setInkEcho(bool enabled, const QColor &color, qreal minWidth, qreal maxWidth) {
+    _inkEcho = enabled;
+    _inkColor = color;
+    _inkMinWidth = minWidth;
+    _inkMaxWidth = std::max(minWidth, maxWidth);
+    if(!enabled) {
+        dropProvisionalInk(QRect());
+    }
+}
+
+void FBController::echoPenSample(const QPointF &point, qreal pressure) {
+    if(!_inkEcho || !_penDown || !image || _provisionalInk.size() >= INK_ECHO_MAX_SEGMENTS) {
+        _lastPenPoint = point;
+        return;
+    }
+    if(!_inkClock.isValid()) {
+        _inkClock.start();
+    }
+    InkSegment segment;
+    segment.from = _lastPenPoint;
+    segment.to = point;
+    segment.width = _inkMinWidth + (_inkMaxWidth - _inkMinWidth) * std::clamp(pressure, 0.0, 1.0);
+    int margin = (int) (segment.width / 2) + 2;
+    segment.bounds = QRect(
+        (int) std::min(segment.from.x(), segment.to.x()) - margin,
+        (int) std::min(segment.from.y(), segment.to.y()) - margin,
+        (int) std::abs(segment.to.x() - segment.from.x()) + 2 * margin,
+        (int) std::abs(segment.to.y() - segment.from.y()) + 2 * margin
+    );
+    segment.drawnAt = _inkClock.elapsed();
+    _provisionalInk.push_back(segment);
+    _lastPenPoint = point;
+
+    // Straight to the scene graph - waiting on the frame rate cap would defeat the purpose.
+    if(_visibility == VISIBILITY_VISIBLE) {
+        update(toItemRect(segment.bounds));
+    }
+    if(!_inkExpiryPending) {
+        _inkExpiryPending = true;
+        QTimer::singleShot(INK_ECHO_EXPIRY_MS, this, [this]() {
+            _inkExpiryPending = false;
+            expireProvisionalInk();
+        });
+    }
+}
+
+void FBController::dropProvisionalInk(const QRect &rect) {
+    // A null rect is a complete update.
+    auto dropped = std::remove_if(_provisionalInk.begin(), _provisionalInk.end(), [&rect](const InkSegment &segment) {
+        return rect.isNull() || rect.intersects(segment.bounds);
+    });
+    // Whatever the client drew over them is repainted by its update, the rest has to be cleaned up.
+    for(auto segment = dropped; segment != _provisionalInk.end(); segment++) {
+        if(!rect.isNull() && !rect.contains(segment->bounds)) {
+            update(toItemRect(segment->bounds));
+        }
+    }
+    _provisionalInk.erase(dropped, _provisionalInk.end());
+}
+
+void FBController::expireProvisionalInk() {
+    qint64 cutoff = _inkClock.elapsed() - INK_ECHO_EXPIRY_MS;
+    auto expired = std::remove_if(_provisionalInk.begin(), _provisionalInk.end(), [cutoff](const InkSegment &segment) {
+        return segment.drawnAt <= cutoff;
+    });
+    for(auto segment = expired; segment != _provisionalInk.end(); segment++) {
+        update(toItemRect(segment->bounds));
+    }
+    _provisionalInk.erase(expired, _provisionalInk.end());
+    if(!_provisionalInk.empty()) {
+        _inkExpiryPending = true;
+        QTimer::singleShot(_provisionalInk.front().drawnAt + INK_ECHO_EXPIRY_MS - _inkClock.elapsed(), this, [this]() {
+            _inkExpiryPending = false;
+            expireProvisionalInk();
+        });
+    }
+}
+
+void FBController::setMaxFrameRate(int fps) {
+    maxFrameRate = fps;
+}
+
+void FBController::setOccluded(bool o) {
+    _occluded = o;
+    updateVisibility();
+}
+
+bool FBController::occluded() const {
+    return _occluded;
+}
+
+void FBController::itemChange(ItemChange change, const ItemChangeData &value) {
+    QQuickPaintedItem::itemChange(change, value);
+    if(change == ItemVisibleHasChanged) {
+        updateVisibility();
+    }
+}
+
+void FBController::updateVisibility() {
+    int visibility = VISIBILITY_VISIBLE;
+    if(!isVisible()) {
+        visibility = VISIBILITY_HIDDEN;
+    } else if(_occluded) {
+        visibility = VISIBILITY_OCCLUDED;
+    }
+    if(visibility == _visibility) return;
+
+    QDEBUG << "Framebuffer" << _framebufferID << "visibility changed to" << visibility;
+    _visibility = visibility;
+    if(_framebufferID != -1) {
+        qtfb::management::forwardVisibility(_framebufferID, visibility);
+    }
+    if(_visibility == VISIBILITY_VISIBLE && _pendingUpdate) {
+        _pendingUpdate = false;
+        markedUpdate();
+    }
+}
+
 void FBController::setAllowScaling(bool a){
     _allowScaling = a;
 }
@@ -117,6 +396,8 @@ void FBController::mousePressEvent(QMouseEvent *me) {
             .d = (int) (point.pressure() * 100.0),
         };
         qtfb::management::forwardUserInput(_framebufferID, &packet);
+        _penDown = true;
+        _lastPenPoint = QPointF(conv);
     }
     me->accept();
 }
@@ -133,6 +414,7 @@ void FBController::mouseMoveEvent(QMouseEvent *me) {
             .d = (int) (point.pressure() * 100.0),
         };
         qtfb::management::forwardUserInput(_framebufferID, &packet);
+        echoPenSample(QPointF(conv), point.pressure());
     }
     me->accept();
 }
@@ -169,6 +451,7 @@ void FBController::mouseReleaseEvent(QMouseEvent *me) {
             .d = 0,
         };
         qtfb::management::forwardUserInput(_framebufferID, &packet);
+        _penDown = false;
     }
     me->accept();
 }
@@ -12,12 +12,18 @@
 #include <QJsonObject>
 #include <QJsonValue>
 #include <QQuickPaintedItem>
+#include <QElapsedTimer>
+#include <QColor>
+#include <vector>
+
+#include "common.h"
 
 class FBController : public QQuickPaintedItem
 {
     Q_PROPERTY(bool active READ active NOTIFY activeChanged)
     Q_PROPERTY(int framebufferID READ framebufferID WRITE setFramebufferID)
     Q_PROPERTY(bool allowScaling READ allowScaling WRITE setAllowScaling)
+    Q_PROPERTY(bool occluded READ occluded WRITE setOccluded)
     Q_OBJECT
 public:
     explicit FBController(QQuickItem *parent = nullptr) : QQuickPaintedItem(parent) { setAcceptTouchEvents(true); setAcceptedMouseButtons((Qt::MouseButtons) 0xFFFFFFFF); setFocusPolicy(Qt::StrongFocus); }
@@ -31,11 +37,32 @@ public:
 
     bool active() const;
 
+    // Set by the window manager when the item is entirely covered by other windows.
+    void setOccluded(bool o);
+    bool occluded() const;
+
     void markedUpdate(const QRect &rect = QRect());
+    // Like markedUpdate(), but the client gets a frame credit once it's been painted.
+    void clientFrameSubmitted(const QRect &rect = QRect());
+    // Caps how often any controller repaints (power saving). 0 means no limit.
+    static void setMaxFrameRate(int fps);
     void setActive(bool active); // NOT QML ACCESSIBLE!
     bool isMidPaint;
     virtual void paint(QPainter *painter);
     void associateSHM(QImage *image);
+    void rebindSHM(QImage *image); // GUI thread only
+    // Composites `overlay` on top of the image at `position`. Only the rects the overlay covered
+    // before and covers now are repainted. GUI thread only.
+    void setOverlay(QImage *overlay, const QPoint &position, bool visible);
+    // Shown instead of the surface until the client's first update - the app's last frame
+    // from its previous run.
+    void setPlaceholder(const QImage &placeholder);
+    // Wet ink: draws pen strokes right away, without waiting for the client to render them.
+    // A provisional segment is dropped once the client updates a region touching it.
+    void setInkEcho(bool enabled, const QColor &color, qreal minWidth, qreal maxWidth);
+    // A 1/THUMBNAIL_SCALE copy of what the controller shows (see thumbnails.h). Only the areas
+    // updated since the last call are filtered again. GUI thread only.
+    QImage thumbnail();
 
     QPoint convertPointToQTFBPixels(const QPointF &input);
 
@@ -46,6 +73,7 @@ public:
 
     virtual void keyPressEvent(QKeyEvent *ke) override;
     virtual void keyReleaseEvent(QKeyEvent *ke) override;
+    virtual void itemChange(ItemChange change, const ItemChangeData &value) override;
 
 
     Q_INVOKABLE void specialKeyDown(int key);
@@ -59,6 +87,51 @@ private:
     int _framebufferID = -1;
     bool _active = false;
     bool _allowScaling = false;
+    bool _occluded = false;
+    int _visibility = VISIBILITY_VISIBLE;
+    // An update was requested while the controller was not visible.
+    bool _pendingUpdate = false;
+    // The client is waiting for the next paint to get its frame credit.
+    bool _creditOwed = false;
+    bool _deferredUpdate = false;
+    QElapsedTimer lastPaint;
+    static int maxFrameRate;
+
+    void updateVisibility();
 
     QImage *image = nullptr;
+    QImage placeholder;
+    // The client has submitted a frame since the controller was associated.
+    bool _receivedFrame = false;
+    QImage _thumbnail;
+    // Surface area updated since _thumbnail was last brought up to date.
+    QRect _thumbnailDamage;
+    bool _thumbnailStale = true;
+    QImage *overlay = nullptr;
+    QPoint overlayPosition;
+    bool overlayVisible = false;
+    // Where the overlay ends up in item coordinates.
+    QRect overlayTarget() const;
+    // Maps a rect of the client's surface to item coordinates.
+    QRect toItemRect(const QRect &rect) const;
+
+    struct InkSegment {
+        QPointF from, to;
+        qreal width;
+        // In surface pixels
+        QRect bounds;
+        qint64 drawnAt;
+    };
+    bool _inkEcho = false;
+    QColor _inkColor;
+    qreal _inkMinWidth = 1, _inkMaxWidth = 1;
+    bool _penDown = false;
+    QPointF _lastPenPoint;
+    std::vector<InkSegment> _provisionalInk;
+    QElapsedTimer _inkClock;
+    bool _inkExpiryPending = false;
+
+    void echoPenSample(const QPointF &point, qreal pressure);
+    void dropProvisionalInk(const QRect &rect);
+    void expireProvisionalInk();
 };
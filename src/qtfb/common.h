@@ -17,6 +17,16 @@
 #define MESSAGE_CUSTOM_INITIALIZE 2
 #define MESSAGE_TERMINATE 3
 #define MESSAGE_USERINPUT 4
+#define MESSAGE_RECONFIGURE 5
+#define MESSAGE_VISIBILITY 6
+#define MESSAGE_FRAME_CREDIT 7
+#define MESSAGE_IMPORT_BUFFER 8
+#define MESSAGE_PRESENT_BUFFER 9
+#define MESSAGE_OVERLAY 10
+#define MESSAGE_INK_ECHO 11
+// Opts the connection into MESSAGE_FRAME_CREDIT. Clients which never read their socket must not
+// send it. No data, no reply.
+#define MESSAGE_REQUEST_FRAME_CREDITS 12
 
 #define FBFMT_RM2FB 0
 #define FBFMT_RMPP_RGB888 1
@@ -26,9 +36,21 @@
 #define FBFMT_RMPPM_RGBA8888 5
 #define FBFMT_RMPPM_RGB565 6
 
+// Client-allocated buffers a framebuffer can have imported at once.
+#define QTFB_MAX_IMPORTED_BUFFERS 4
+
+#define OVERLAY_ATTACH 0
+#define OVERLAY_SHOW 1
+#define OVERLAY_HIDE 2
+#define OVERLAY_DETACH 3
+
 #define UPDATE_ALL 0
 #define UPDATE_PARTIAL 1
 
+#define VISIBILITY_HIDDEN 0
+#define VISIBILITY_VISIBLE 1
+#define VISIBILITY_OCCLUDED 2
+
 #define INPUT_TOUCH_PRESS 0x10
 #define INPUT_TOUCH_RELEASE 0x11
 #define INPUT_TOUCH_UPDATE 0x12
@@ -64,24 +86,89 @@ namespace qtfb {
         size_t shmSize;
     };
 
+    struct ReconfigureMessageContents {
+        uint8_t framebufferType;
+        uint16_t width;
+        uint16_t height;
+    };
+
+    struct ReconfigureMessageResponseContents {
+        int shmKeyDefined;
+        uint16_t width;
+        uint16_t height;
+        size_t shmSize;
+        uint32_t stride;
+        uint8_t framebufferType;
+    };
+
     struct UpdateRegionMessageContents {
         int type;
         int x, y, w, h;
     };
 
+    // Sent along with the buffer's fd (SCM_RIGHTS). The fd must be a memfd sealed against
+    // shrinking. The first import of a connection initializes it, like MESSAGE_INITIALIZE,
+    // further ones add or replace slots of the same geometry.
+    // The server replies with MESSAGE_IMPORT_BUFFER (shmKeyDefined = -1) or disconnects.
+    struct ImportBufferMessageContents {
+        FBKey framebufferKey;
+        uint8_t framebufferType;
+        uint8_t slot;
+        uint16_t width;
+        uint16_t height;
+        uint32_t stride;
+        uint32_t offset;
+    };
+
+    // Shows the imported buffer in `slot` from now on, and updates the given region of it.
+    struct PresentBufferMessageContents {
+        int slot;
+        struct UpdateRegionMessageContents update;
+    };
+
     struct UserInputContents {
         int inputType;
         int devId;
         int x, y, d;
     };
 
+    struct VisibilityContents {
+        int state;
+    };
+
+    // OVERLAY_ATTACH allocates a width x height RGBA8888 overlay (replacing the previous one).
+    // The server replies with MESSAGE_OVERLAY, carrying the overlay's SHM in `init`.
+    // OVERLAY_SHOW shows it at x, y and repaints it, OVERLAY_HIDE / OVERLAY_DETACH ignore both.
+    struct OverlayMessageContents {
+        int operation;
+        int x, y;
+        uint16_t width;
+        uint16_t height;
+    };
+
+    // Lets the compositor draw pen strokes itself, straight from the input it forwards, until
+    // the client's own update for that region arrives. Widths are in surface pixels, and get
+    // interpolated by pen pressure. color is 0xAARRGGBB.
+    struct InkEchoMessageContents {
+        int enabled;
+        uint32_t color;
+        uint16_t minWidth;
+        uint16_t maxWidth;
+    };
+
     struct ClientMessage {
         uint8_t type;
         union {
             struct InitMessageContents init;
             struct UpdateRegionMessageContents update;
             struct CustomInitMessageContents customInit;
+            struct ReconfigureMessageContents reconfigure;
+            struct ImportBufferMessageContents importBuffer;
+            struct PresentBufferMessageContents presentBuffer;
+            struct OverlayMessageContents overlay;
+            struct InkEchoMessageContents inkEcho;
             // struct TerminateMessageContents terminate; - Terminate does not send any data.
+            // Neither does MESSAGE_REQUEST_FRAME_CREDITS.
         };
     };
 
@@ -90,6 +177,9 @@ namespace qtfb {
         union {
             struct InitMessageResponseContents init;
             struct UserInputContents userInput;
+            struct ReconfigureMessageResponseContents reconfigure;
+            struct VisibilityContents visibility;
+            // struct FrameCreditContents frameCredit; - Frame credit does not send any data.
         };
     };
 }
@@ -1,8 +1,13 @@
 #include "fbmanagement.h"
 #include "log.h"
 #include "common.h"
+#include "shmpool.h"
+#include "snapshots.h"
 #include <iostream>
+#include <condition_variable>
+#include <functional>
 #include <mutex>
+#include <QCoreApplication>
 /*
 My implementation of the shared QT-framebuffer idea works by:
 - Having all the clients communicate with the server via a UNIX socket, which governs
@@ -15,14 +20,93 @@ My implementation of the shared QT-framebuffer idea works by:
 - In order to paint data on the screen, the client will write the data into the SHM, then
   send an update request via the unix socket. That will cause the server to read the SHM
   and force a repaint.
+- A connected client can change the format / resolution of its framebuffer in place by sending
+  a reconfigure request. The server resizes the SHM (keeping its key), rebinds the controller
+  and tells every connection of that framebuffer about the new geometry, so they can remap.
 - Upon framebuffer detaching, the server will send the client a packet telling it to stop
   writing data to the SHM, and disconnect. The server will delete the shared memory and
   detach everything.
+- When the last connection of a framebuffer goes away, its surface lingers (still shown) for
+  a grace period, so that a client restarting under the same key gets it back as it was.
+  Unclaimed surfaces are then detached, and their SHM is pooled for reuse by later clients.
+- The launcher can preallocate a framebuffer's surface while the client process is starting.
+  It lingers (unassociated) the same way until the client's init attaches to it.
+- Once the frame a client submitted has been painted, the server grants it a frame credit.
+  Clients that wait for it before rendering the next frame never get ahead of the compositor.
+- Instead of initializing, a client can import buffers it allocated itself (memfds, passed over
+  the socket). The server maps them read-only and paints straight from them. The client then
+  presents one of them at a time - once that frame's credit arrives, the previously presented
+  buffer is free to be drawn into again. Imported surfaces go away with their client.
+- A client can also attach a small overlay (its own SHM) to its framebuffer, and show / move it
+  independently of the main surface. The controller composites it on top, so a cursor or a
+  stroke being drawn only ever repaints the overlay's rects. Overlays go away with the last
+  connection of their framebuffer.
+- When the last connection of a framebuffer launched for an app goes away, its last frame is
+  kept as a snapshot of that app. The app's next window shows it until the client's first update.
+- Drawing apps can turn on ink echo: the controller then draws pen strokes itself, as soon as
+  the input arrives, and drops them once the client's own update covers them.
 */
 
 static std::mutex globalBackendsListMutex;
 #define SYNCHRONIZE const std::lock_guard<std::mutex> __lock(globalBackendsListMutex)
 
+struct LingeringBackend {
+    qtfb::management::ClientBackend *backend;
+    qtfb::management::pool::TimePoint deadline;
+    // Preallocated backends have never been associated with a controller.
+    bool preallocated = false;
+};
+static std::map<qtfb::FBKey, LingeringBackend> lingeringBackends;
+static std::condition_variable reaperWakeup;
+
+// Puts the backend's segment into the pool, and lets the reaper know it has a new expiry to
+// keep track of. Must be called with the backend list lock held.
+static void retireBackend(qtfb::management::ClientBackend *backend) {
+    qtfb::management::pool::retire(backend);
+    reaperWakeup.notify_one();
+}
+// The sockets of every framebuffer's clients. Frame credits and visibility changes are sent
+// from the GUI thread, so they go through this (and its own lock) rather than the backend list.
+static std::mutex clientSocketsMutex;
+static std::multimap<qtfb::FBKey, qtfb::management::ClientConnection *> clientSockets;
+// Last visibility state of every framebuffer that isn't VISIBILITY_VISIBLE, so that clients
+// attaching later can be told about it right away. Guarded by clientSocketsMutex.
+static std::map<qtfb::FBKey, int> framebufferVisibility;
+
+// Also tells the client if its framebuffer isn't visible right now. Doesn't block, like the
+// other sends going through this list.
+static void addClientSocket(qtfb::management::ClientConnection *connection) {
+    const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+    clientSockets.emplace(connection->fbKey, connection);
+    auto position = framebufferVisibility.find(connection->fbKey);
+    if(position != framebufferVisibility.end()) {
+        qtfb::ServerMessage outbound = {
+            .type = MESSAGE_VISIBILITY,
+            .visibility = {
+                .state = position->second,
+            },
+        };
+        send(connection->clientFD, &outbound, sizeof(outbound), MSG_DONTWAIT);
+    }
+}
+
+// Must happen before the socket is closed - the fd could be reused right away.
+static void removeClientSocket(qtfb::management::ClientConnection *connection) {
+    const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+    auto range = clientSockets.equal_range(connection->fbKey);
+    for(auto position = range.first; position != range.second; position++) {
+        if(position->second == connection) {
+            clientSockets.erase(position);
+            return;
+        }
+    }
+}
+
+static void enableFrameCredits(qtfb::management::ClientConnection *connection) {
+    const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+    connection->frameCredits = true;
+}
+
 void tryToMatchUp(qtfb::FBKey key){
     // Try to find the client in the clients' list
     if(qtfb::management::connections.find(key) == qtfb::management::connections.end()) {
@@ -54,6 +138,27 @@ void qtfb::management::registerController(FBKey key, QPointer<FBController> cont
     CERR << "Registered framebuffer controller ID: " << key << std::endl;
     framebuffers.emplace(key, controller);
     tryToMatchUp(key);
+    offerPlaceholder(key);
+}
+
+void qtfb::management::offerPlaceholder(FBKey key) {
+    auto position = qtfb::management::framebuffers.find(key);
+    if(position == qtfb::management::framebuffers.end() || position->second.isNull()) {
+        // Picked up by registerController() later.
+        return;
+    }
+    QImage placeholder = qtfb::snapshots::takePlaceholder(key);
+    if(!placeholder.isNull()) {
+        position->second->setPlaceholder(placeholder);
+    }
+}
+
+QImage qtfb::management::thumbnail(FBKey key) {
+    auto position = qtfb::management::framebuffers.find(key);
+    if(position == qtfb::management::framebuffers.end() || position->second.isNull()) {
+        return QImage();
+    }
+    return position->second->thumbnail();
 }
 
 bool qtfb::management::isControllerAssociated(FBKey key) {
@@ -66,14 +171,22 @@ void qtfb::management::unregisterController(FBKey key) {
     if(position != qtfb::management::framebuffers.end()) {
         qtfb::management::framebuffers.erase(position);
     }
+    {
+        const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+        framebufferVisibility.erase(key);
+    }
+    {
+        SYNCHRONIZE;
+        // A connected client still gets its snapshot taken as it disconnects. Otherwise nothing
+        // would ever capture() and unbind it, and the key may be reused for another app.
+        if(!qtfb::management::isControllerAssociated(key)) {
+            qtfb::snapshots::unbind(key);
+        }
+    }
     CERR << "Unregistered framebuffer controller ID: " << key << std::endl;
 }
 
-static bool createSHM(qtfb::management::ClientBackend *connection, int shmType, int width, int height) {
-    size_t shmSize;
-    QImage::Format format;
-    int bpl;
-
+static bool getFormatParameters(int shmType, int width, int height, size_t &shmSize, QImage::Format &format, int &bpl) {
     switch(shmType) {
         case FBFMT_RM2FB:
             shmSize = height * width * 2;
@@ -102,9 +215,62 @@ static bool createSHM(qtfb::management::ClientBackend *connection, int shmType,
             CERR << "Unknown SHM type" << shmType << std::endl;
             return false;
     }
+    return true;
+}
+
+static void getDefaultResolution(int shmType, int &width, int &height) {
+    switch(shmType) {
+        case FBFMT_RM2FB:
+            width = RM2_WIDTH, height = RM2_HEIGHT;
+            break;
+        case FBFMT_RMPP_RGB888:
+        case FBFMT_RMPP_RGBA8888:
+        case FBFMT_RMPP_RGB565:
+            width = RMPP_WIDTH, height = RMPP_HEIGHT;
+            break;
+        case FBFMT_RMPPM_RGB888:
+        case FBFMT_RMPPM_RGBA8888:
+        case FBFMT_RMPPM_RGB565:
+            width = RMPPM_WIDTH, height = RMPPM_HEIGHT;
+            break;
+        default:
+            width = -1, height = -1;
+    }
+}
+
+// `reused` is set if the segment came from the pool. It then still holds its previous owner's
+// last frame, and has to be cleared before anyone gets to see it - ideally without the backend
+// list lock held.
+static bool createSHM(qtfb::management::ClientBackend *connection, int shmType, int width, int height, bool &reused) {
+    size_t shmSize;
+    QImage::Format format;
+    int bpl;
+
+    if(!getFormatParameters(shmType, width, height, shmSize, format, bpl)) {
+        return false;
+    }
     CERR << "Client is connecting in " << shmType << " mode. Resolution is set to " << width << "x" << height << std::endl;
 
+    qtfb::management::ClientBackend *pooled = qtfb::management::pool::acquire(shmSize);
+    reused = pooled != NULL;
+    if(pooled) {
+        connection->shmFD = pooled->shmFD;
+        connection->shmKey = pooled->shmKey;
+        connection->shm = pooled->shm;
+        connection->shmCapacity = pooled->shmCapacity;
+        connection->shmSize = shmSize;
+        connection->shmType = shmType;
+        pooled->shmFD = -1;
+        pooled->shmKey = -1;
+        pooled->shm = NULL;
+        delete pooled;
+        CERR << "Reusing pooled SHM (" << connection->shmCapacity << " bytes) at " << (void *) connection->shm << std::endl;
+        connection->image = new QImage(connection->shm, width, height, bpl, format, nullptr, nullptr);
+        return true;
+    }
+
     connection->shmSize = shmSize;
+    connection->shmCapacity = shmSize;
     connection->shmType = shmType;
     connection->shmKey = rand() & ~0x80000000;
     FORMAT_SHM(shmText, connection->shmKey);
@@ -126,6 +292,7 @@ static bool createSHM(qtfb::management::ClientBackend *connection, int shmType,
         connection->shmFD = -1;
         connection->shm = NULL;
         connection->shmSize = 0;
+        connection->shmCapacity = 0;
         connection->shmType = -1;
         connection->shmKey = -1;
         return false;
@@ -137,30 +304,143 @@ static bool createSHM(qtfb::management::ClientBackend *connection, int shmType,
     return true;
 }
 
-static bool createDefaultSHM(qtfb::management::ClientBackend *connection, int shmType) {
-    switch(shmType) {
-        case FBFMT_RM2FB:
-            return createSHM(connection, shmType, RM2_WIDTH, RM2_HEIGHT);
-        case FBFMT_RMPP_RGB888:
-        case FBFMT_RMPP_RGBA8888:
-        case FBFMT_RMPP_RGB565:
-            return createSHM(connection, shmType, RMPP_WIDTH, RMPP_HEIGHT);
-        case FBFMT_RMPPM_RGB888:
-        case FBFMT_RMPPM_RGBA8888:
-        case FBFMT_RMPPM_RGB565:
-            return createSHM(connection, shmType, RMPPM_WIDTH, RMPPM_HEIGHT);
-        default:
-            return createSHM(connection, shmType, -1, -1);
+static bool createDefaultSHM(qtfb::management::ClientBackend *connection, int shmType, bool &reused) {
+    int width, height;
+    getDefaultResolution(shmType, width, height);
+    return createSHM(connection, shmType, width, height, reused);
+}
+
+// Detaches the controller from its surface on the GUI thread, the same way rebindController()
+// swaps it - no waiting for paint() to finish while the backend list lock is held.
+// `release` frees the old surface afterwards, with the backend list lock held.
+// Must be called with the backend list lock held.
+static void disassociateController(qtfb::FBKey key, std::function<void()> release) {
+    QPointer<FBController> controller;
+    auto position = qtfb::management::framebuffers.find(key);
+    if(position != qtfb::management::framebuffers.end()) {
+        controller = position->second;
     }
+    QMetaObject::invokeMethod(QCoreApplication::instance(), [controller, key, release]() {
+        SYNCHRONIZE;
+        // A new client may have taken the framebuffer over in the meantime.
+        if(!controller.isNull() && !qtfb::management::isControllerAssociated(key)) {
+            controller->associateSHM(NULL);
+            CERR << "Disassociating framebuffer " << key << std::endl;
+        }
+        release();
+    }, Qt::QueuedConnection);
+}
+
+// Rebinds the controller to the backend's new image on the GUI thread. The scene graph only
+// calls paint() while the GUI thread is blocked, so the swap is atomic from paint()'s point of view.
+// `release` frees whatever the controller was using before, and always runs after the swap.
+static void rebindController(qtfb::FBKey key, QImage *image, std::function<void()> release) {
+    auto position = qtfb::management::framebuffers.find(key);
+    if(position == qtfb::management::framebuffers.end() || position->second.isNull()) {
+        release();
+        return;
+    }
+    QPointer<FBController> controller = position->second;
+    QMetaObject::invokeMethod(QCoreApplication::instance(), [controller, key, image, release]() {
+        if(!controller.isNull() && qtfb::management::isControllerAssociated(key)) {
+            controller->rebindSHM(image);
+        }
+        release();
+    }, Qt::QueuedConnection);
+}
+
+// Shows / moves / hides the controller's overlay on the GUI thread. Same as rebindController(),
+// `release` frees the overlay that was replaced, after the swap.
+static void rebindOverlay(qtfb::FBKey key, QImage *overlay, QPoint position, bool visible, std::function<void()> release) {
+    auto controllerPosition = qtfb::management::framebuffers.find(key);
+    if(controllerPosition == qtfb::management::framebuffers.end() || controllerPosition->second.isNull()) {
+        release();
+        return;
+    }
+    QPointer<FBController> controller = controllerPosition->second;
+    QMetaObject::invokeMethod(QCoreApplication::instance(), [controller, key, overlay, position, visible, release]() {
+        // Removing the overlay has to happen even if the framebuffer was disassociated meanwhile.
+        if(!controller.isNull() && (overlay == nullptr || qtfb::management::isControllerAssociated(key))) {
+            controller->setOverlay(overlay, position, visible);
+        }
+        release();
+    }, Qt::QueuedConnection);
+}
+
+// Must be called with the backend list lock held.
+static void detachOverlay(qtfb::management::ClientBackend *backend, qtfb::FBKey key) {
+    if(backend->overlay == NULL) {
+        return;
+    }
+    qtfb::management::ClientBackend *overlay = backend->overlay;
+    backend->overlay = NULL;
+    backend->overlayVisible = false;
+    rebindOverlay(key, nullptr, QPoint(), false, [overlay]() {
+        delete overlay;
+    });
+}
+
+static bool reconfigureSHM(qtfb::management::ClientBackend *backend, qtfb::FBKey key, int shmType, int width, int height) {
+    size_t shmSize;
+    QImage::Format format;
+    int bpl;
+
+    if(width == 0 || height == 0) {
+        getDefaultResolution(shmType, width, height);
+    }
+    if(!getFormatParameters(shmType, width, height, shmSize, format, bpl)) {
+        return false;
+    }
+    CERR << "Reconfiguring framebuffer " << key << " to " << shmType << " mode. Resolution is set to " << width << "x" << height << std::endl;
+
+    // The SHM object (and with it the key) stays the same. If the new surface fits in what's
+    // already mapped, reuse the mapping - otherwise grow the object and map it again.
+    unsigned char *shm = backend->shm;
+    size_t shmCapacity = backend->shmCapacity;
+    if(shmSize > shmCapacity) {
+        if(ftruncate(backend->shmFD, shmSize) == -1) {
+            CERR << "Failed to grow the SHM!" << std::endl;
+            return false;
+        }
+        shm = (unsigned char *) mmap(NULL, shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, backend->shmFD, 0);
+        if(shm == MAP_FAILED) {
+            CERR << "Failed to mmap() the grown SHM!" << std::endl;
+            return false;
+        }
+        shmCapacity = shmSize;
+    }
+
+    QImage *oldImage = backend->image;
+    unsigned char *oldShm = backend->shm;
+    size_t oldCapacity = backend->shmCapacity;
+
+    backend->image = new QImage(shm, width, height, bpl, format, nullptr, nullptr);
+    backend->shm = shm;
+    backend->shmSize = shmSize;
+    backend->shmCapacity = shmCapacity;
+    backend->shmType = shmType;
+
+    rebindController(key, backend->image, [oldImage, oldShm, oldCapacity, shm]() {
+        delete oldImage;
+        if(oldShm != shm) {
+            munmap(oldShm, oldCapacity);
+        }
+    });
+    return true;
 }
 
 static int handleInitialize(qtfb::management::ClientConnection *connection, qtfb::ClientMessage *inbound, int messageType) {
-    SYNCHRONIZE;
+    // Not SYNCHRONIZE - the lock is given up while a reused segment is cleared.
+    std::unique_lock<std::mutex> lock(globalBackendsListMutex);
     connection->fbKey = inbound->init.framebufferKey;
     if(qtfb::management::connections.find(inbound->init.framebufferKey) != qtfb::management::connections.end()) {
         // If there already exists a backend like that, check if the parameters are the same
         // If they are, this is safe.
         qtfb::management::ClientBackend *backend = qtfb::management::connections[inbound->init.framebufferKey];
+        if(backend->imported) {
+            // There's no SHM to hand out.
+            return RESP_ERR;
+        }
         switch(messageType) {
             case MESSAGE_CUSTOM_INITIALIZE:
                 if(backend->shmType != inbound->customInit.framebufferType || backend->image->width() != inbound->customInit.width || backend->image->height() != inbound->customInit.height) {
@@ -184,22 +464,81 @@ static int handleInitialize(qtfb::management::ClientConnection *connection, qtfb
         };
         SEND(outbound);
         backend->connections.push_back(connection);
+        addClientSocket(connection);
+        return RESP_OK;
+    }
+    auto lingering = lingeringBackends.find(connection->fbKey);
+    if(lingering != lingeringBackends.end()) {
+        // Either the client came back before its surface was detached, or the launcher had
+        // preallocated one for it. Hand it over as-is, reshaping it in place if the client asks
+        // for something else.
+        qtfb::management::ClientBackend *backend = lingering->second.backend;
+        lingeringBackends.erase(lingering);
+        int shmType, width, height;
+        switch(messageType) {
+            case MESSAGE_CUSTOM_INITIALIZE:
+                shmType = inbound->customInit.framebufferType;
+                width = inbound->customInit.width;
+                height = inbound->customInit.height;
+                break;
+            case MESSAGE_INITIALIZE:
+                shmType = inbound->init.framebufferType;
+                getDefaultResolution(shmType, width, height);
+                break;
+            default: return RESP_ERR;
+        }
+        qtfb::management::connections[connection->fbKey] = backend;
+        if(backend->shmType != shmType || backend->image->width() != width || backend->image->height() != height) {
+            if(!reconfigureSHM(backend, connection->fbKey, shmType, width, height)) {
+                qtfb::management::connections.erase(connection->fbKey);
+                disassociateController(connection->fbKey, [backend]() {
+                    retireBackend(backend);
+                });
+                return RESP_ERR;
+            }
+        }
+        CERR << "Attached to lingering framebuffer " << connection->fbKey << std::endl;
+        qtfb::ServerMessage outbound = {
+            .type = MESSAGE_INITIALIZE,
+            .init = {
+                .shmKeyDefined = backend->shmKey,
+                .shmSize = backend->shmSize,
+            },
+        };
+        SEND(outbound);
+        backend->connections.push_back(connection);
+        addClientSocket(connection);
+        tryToMatchUp(connection->fbKey);
         return RESP_OK;
     }
     qtfb::management::ClientBackend *newBackend = new qtfb::management::ClientBackend();
+    bool reused = false;
     bool result = false;
     switch(messageType) {
         case MESSAGE_CUSTOM_INITIALIZE:
-            result = createSHM(newBackend, inbound->customInit.framebufferType, inbound->customInit.width, inbound->customInit.height);
+            result = createSHM(newBackend, inbound->customInit.framebufferType, inbound->customInit.width, inbound->customInit.height, reused);
             break;
         case MESSAGE_INITIALIZE:
-            result = createDefaultSHM(newBackend, inbound->init.framebufferType);
+            result = createDefaultSHM(newBackend, inbound->init.framebufferType, reused);
             break;
     }
     if(!result) {
         delete newBackend;
         return RESP_ERR;
     }
+    // Nobody else can see the new backend yet - clear a reused segment without stalling the
+    // other clients, like preallocationThread() does.
+    if(reused) {
+        lock.unlock();
+        memset(newBackend->shm, 0, newBackend->shmSize);
+        lock.lock();
+        if(qtfb::management::connections.find(connection->fbKey) != qtfb::management::connections.end() || lingeringBackends.find(connection->fbKey) != lingeringBackends.end()) {
+            // Another client (or the preallocation) got there in the meantime - join that one instead.
+            retireBackend(newBackend);
+            lock.unlock();
+            return handleInitialize(connection, inbound, messageType);
+        }
+    }
     // Send the SHM key over to the client
     qtfb::ServerMessage outbound = {
         .type = MESSAGE_INITIALIZE,
@@ -210,6 +549,7 @@ static int handleInitialize(qtfb::management::ClientConnection *connection, qtfb
     };
     SEND(outbound);
     newBackend->connections.push_back(connection);
+    addClientSocket(connection);
     qtfb::management::connections[connection->fbKey] = newBackend;
     tryToMatchUp(connection->fbKey);
     return RESP_OK;
@@ -231,14 +571,14 @@ static int handleUpdateRegion(qtfb::management::ClientConnection *connection, qt
             case UPDATE_ALL:
                 CERR << "Updated all of framebuffer " << connection->fbKey << std::endl;
                 QMetaObject::invokeMethod(controller, [controller]() {
-                    controller->markedUpdate();
+                    controller->clientFrameSubmitted();
                 }, Qt::QueuedConnection);
                 break;
             case UPDATE_PARTIAL:
                 CERR << "Updated region " << inbound->update.x << " " << inbound->update.y << " " << inbound->update.w << " " << inbound->update.h << " of framebuffer " << connection->fbKey << std::endl;
                 x = inbound->update.x, y = inbound->update.y, w = inbound->update.w, h = inbound->update.h;
                 QMetaObject::invokeMethod(controller, [controller, x, y, w, h]() {
-                    controller->markedUpdate(QRect(
+                    controller->clientFrameSubmitted(QRect(
                         x,
                         y,
                         w,
@@ -257,6 +597,322 @@ static int handleUpdateRegion(qtfb::management::ClientConnection *connection, qt
     return RESP_OK;
 }
 
+static int handleReconfigure(qtfb::management::ClientConnection *requester, qtfb::ClientMessage *inbound) {
+    SYNCHRONIZE;
+    if(requester->fbKey == -1) {
+        CERR << "Cannot reconfigure an uninitialized connection!" << std::endl;
+        return RESP_ERR;
+    }
+    auto position = qtfb::management::connections.find(requester->fbKey);
+    if(position == qtfb::management::connections.end()) {
+        return RESP_ERR;
+    }
+    qtfb::management::ClientBackend *backend = position->second;
+    if(backend->imported) {
+        CERR << "Cannot reconfigure imported buffers - import new ones instead." << std::endl;
+        return RESP_ERR;
+    }
+    if(!reconfigureSHM(backend, requester->fbKey, inbound->reconfigure.framebufferType, inbound->reconfigure.width, inbound->reconfigure.height)) {
+        return RESP_ERR;
+    }
+
+    // Every connection sharing this backend has to remap.
+    qtfb::ServerMessage outbound = {
+        .type = MESSAGE_RECONFIGURE,
+        .reconfigure = {
+            .shmKeyDefined = backend->shmKey,
+            .width = (uint16_t) backend->image->width(),
+            .height = (uint16_t) backend->image->height(),
+            .shmSize = backend->shmSize,
+            .stride = (uint32_t) backend->image->bytesPerLine(),
+            .framebufferType = (uint8_t) backend->shmType,
+        },
+    };
+    for(qtfb::management::ClientConnection *connection : backend->connections) {
+        SEND(outbound);
+    }
+    return RESP_OK;
+}
+
+static int handleOverlay(qtfb::management::ClientConnection *connection, qtfb::ClientMessage *inbound) {
+    SYNCHRONIZE;
+    auto position = qtfb::management::connections.find(connection->fbKey);
+    if(connection->fbKey == -1 || position == qtfb::management::connections.end()) {
+        CERR << "Cannot attach an overlay to an uninitialized connection!" << std::endl;
+        return RESP_ERR;
+    }
+    qtfb::management::ClientBackend *backend = position->second;
+    const qtfb::OverlayMessageContents &contents = inbound->overlay;
+    switch(contents.operation) {
+        case OVERLAY_ATTACH: {
+            if(contents.width == 0 || contents.height == 0 || contents.width > backend->image->width() || contents.height > backend->image->height()) {
+                CERR << "Invalid overlay size " << contents.width << "x" << contents.height << std::endl;
+                return RESP_ERR;
+            }
+            qtfb::management::ClientBackend *overlay = new qtfb::management::ClientBackend();
+            bool reused;
+            if(!createSHM(overlay, FBFMT_RMPP_RGBA8888, contents.width, contents.height, reused)) {
+                delete overlay;
+                return RESP_ERR;
+            }
+            if(reused) {
+                // Overlays are at most the size of the framebuffer and rarely attached - not
+                // worth giving up the lock for.
+                memset(overlay->shm, 0, overlay->shmSize);
+            }
+            detachOverlay(backend, connection->fbKey);
+            backend->overlay = overlay;
+            qtfb::ServerMessage outbound = {
+                .type = MESSAGE_OVERLAY,
+                .init = {
+                    .shmKeyDefined = overlay->shmKey,
+                    .shmSize = overlay->shmSize,
+                },
+            };
+            SEND(outbound);
+            break;
+        }
+        case OVERLAY_SHOW:
+        case OVERLAY_HIDE:
+            if(backend->overlay == NULL) {
+                CERR << "No overlay attached to framebuffer " << connection->fbKey << std::endl;
+                return RESP_ERR;
+            }
+            if(contents.operation == OVERLAY_SHOW) {
+                backend->overlayPosition = QPoint(contents.x, contents.y);
+            }
+            backend->overlayVisible = contents.operation == OVERLAY_SHOW;
+            rebindOverlay(connection->fbKey, backend->overlay->image, backend->overlayPosition, backend->overlayVisible, []() {});
+            break;
+        case OVERLAY_DETACH:
+            detachOverlay(backend, connection->fbKey);
+            break;
+        default:
+            CERR << "Unknown overlay operation " << contents.operation << std::endl;
+            return RESP_ERR;
+    }
+    return RESP_OK;
+}
+
+static int handleInkEcho(qtfb::management::ClientConnection *connection, qtfb::ClientMessage *inbound) {
+    if(connection->fbKey == -1) {
+        CERR << "Cannot configure ink echo of an uninitialized connection!" << std::endl;
+        return RESP_ERR;
+    }
+    auto position = qtfb::management::framebuffers.find(connection->fbKey);
+    if(position == qtfb::management::framebuffers.end() || position->second.isNull()) {
+        return RESP_OK;
+    }
+    QPointer<FBController> controller = position->second;
+    const qtfb::InkEchoMessageContents contents = inbound->inkEcho;
+    QColor color(
+        (contents.color >> 16) & 0xFF,
+        (contents.color >> 8) & 0xFF,
+        contents.color & 0xFF,
+        (contents.color >> 24) & 0xFF
+    );
+    QMetaObject::invokeMethod(controller, [controller, contents, color]() {
+        controller->setInkEcho(contents.enabled != 0, color, contents.minWidth, contents.maxWidth);
+    }, Qt::QueuedConnection);
+    return RESP_OK;
+}
+
+static void freeImportedBuffer(const qtfb::management::ClientBackend::ImportedBuffer &buffer) {
+    delete buffer.image;
+    if(buffer.mapping != NULL) {
+        munmap(buffer.mapping, buffer.mappingSize);
+    }
+    if(buffer.fd != -1) {
+        close(buffer.fd);
+    }
+}
+
+// Maps a buffer the client allocated. Takes ownership of fd.
+static bool mapImportedBuffer(qtfb::management::ClientBackend::ImportedBuffer &buffer, int fd, const qtfb::ImportBufferMessageContents &contents) {
+    size_t shmSize;
+    QImage::Format format;
+    int bpl;
+
+    if(contents.width == 0 || contents.height == 0 || !getFormatParameters(contents.framebufferType, contents.width, contents.height, shmSize, format, bpl) || contents.stride < (uint32_t) bpl) {
+        CERR << "Invalid geometry of imported buffer" << std::endl;
+        close(fd);
+        return false;
+    }
+    // A client shrinking the buffer under us would take the whole app down with SIGBUS.
+    int seals = fcntl(fd, F_GET_SEALS);
+    if(seals == -1 || !(seals & F_SEAL_SHRINK)) {
+        CERR << "Imported buffer is not sealed against shrinking" << std::endl;
+        close(fd);
+        return false;
+    }
+    size_t mappingSize = contents.offset + (size_t) contents.stride * (contents.height - 1) + bpl;
+    struct stat info;
+    if(fstat(fd, &info) == -1 || (size_t) info.st_size < mappingSize) {
+        CERR << "Imported buffer is too small" << std::endl;
+        close(fd);
+        return false;
+    }
+    unsigned char *mapping = (unsigned char *) mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+    if(mapping == MAP_FAILED) {
+        CERR << "Failed to mmap() the imported buffer!" << std::endl;
+        close(fd);
+        return false;
+    }
+    buffer.fd = fd;
+    buffer.mapping = mapping;
+    buffer.mappingSize = mappingSize;
+    buffer.image = new QImage((const unsigned char *) mapping + contents.offset, contents.width, contents.height, contents.stride, format, nullptr, nullptr);
+    return true;
+}
+
+static void presentImportedBuffer(qtfb::management::ClientBackend *backend, int slot) {
+    backend->presentedSlot = slot;
+    backend->image = backend->importedBuffers[slot].image;
+    backend->shm = backend->importedBuffers[slot].mapping;
+    backend->shmSize = backend->importedBuffers[slot].mappingSize;
+}
+
+static int handleImportBuffer(qtfb::management::ClientConnection *connection, qtfb::ClientMessage *inbound, int fd) {
+    SYNCHRONIZE;
+    const qtfb::ImportBufferMessageContents &contents = inbound->importBuffer;
+    if(fd == -1 || contents.slot >= QTFB_MAX_IMPORTED_BUFFERS) {
+        CERR << "Invalid buffer import request" << std::endl;
+        if(fd != -1) close(fd);
+        return RESP_ERR;
+    }
+
+    qtfb::management::ClientBackend *backend;
+    bool initializing = connection->fbKey == -1;
+    if(initializing) {
+        if(qtfb::management::connections.find(contents.framebufferKey) != qtfb::management::connections.end()) {
+            CERR << "Cannot import buffers into framebuffer " << contents.framebufferKey << " - it is already in use" << std::endl;
+            close(fd);
+            return RESP_ERR;
+        }
+        auto lingering = lingeringBackends.find(contents.framebufferKey);
+        if(lingering != lingeringBackends.end()) {
+            // The client's buffers replace whatever surface was left there.
+            qtfb::management::ClientBackend *replaced = lingering->second.backend;
+            if(lingering->second.preallocated) {
+                retireBackend(replaced);
+            } else {
+                disassociateController(contents.framebufferKey, [replaced]() {
+                    retireBackend(replaced);
+                });
+            }
+            lingeringBackends.erase(lingering);
+        }
+        backend = new qtfb::management::ClientBackend();
+        backend->imported = true;
+        backend->shmType = contents.framebufferType;
+    } else {
+        auto position = qtfb::management::connections.find(connection->fbKey);
+        if(position == qtfb::management::connections.end() || !position->second->imported || contents.framebufferKey != connection->fbKey) {
+            CERR << "Cannot import buffers into a server-allocated framebuffer" << std::endl;
+            close(fd);
+            return RESP_ERR;
+        }
+        backend = position->second;
+        if(contents.framebufferType != backend->shmType || contents.width != backend->image->width() || contents.height != backend->image->height()) {
+            CERR << "All imported buffers of a framebuffer need to have the same format and size" << std::endl;
+            close(fd);
+            return RESP_ERR;
+        }
+    }
+
+    qtfb::management::ClientBackend::ImportedBuffer buffer;
+    if(!mapImportedBuffer(buffer, fd, contents)) {
+        if(initializing) delete backend;
+        return RESP_ERR;
+    }
+    qtfb::management::ClientBackend::ImportedBuffer replaced = backend->importedBuffers[contents.slot];
+    backend->importedBuffers[contents.slot] = buffer;
+    CERR << "Imported buffer " << (int) contents.slot << " (" << contents.width << "x" << contents.height << ", " << buffer.mappingSize << " bytes) into framebuffer " << contents.framebufferKey << std::endl;
+
+    if(initializing) {
+        presentImportedBuffer(backend, contents.slot);
+        connection->fbKey = contents.framebufferKey;
+        backend->connections.push_back(connection);
+        qtfb::management::connections[connection->fbKey] = backend;
+        tryToMatchUp(connection->fbKey);
+    } else if(contents.slot == backend->presentedSlot) {
+        presentImportedBuffer(backend, contents.slot);
+        rebindController(connection->fbKey, backend->image, [replaced]() {
+            freeImportedBuffer(replaced);
+        });
+    } else if(replaced.image != NULL) {
+        // Queued behind any rebind that might still refer to it.
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [replaced]() {
+            freeImportedBuffer(replaced);
+        }, Qt::QueuedConnection);
+    }
+
+    qtfb::ServerMessage outbound = {
+        .type = MESSAGE_IMPORT_BUFFER,
+        .init = {
+            .shmKeyDefined = -1,
+            .shmSize = buffer.mappingSize,
+        },
+    };
+    SEND(outbound);
+    if(initializing) {
+        addClientSocket(connection);
+    }
+    return RESP_OK;
+}
+
+static int handlePresentBuffer(qtfb::management::ClientConnection *connection, qtfb::ClientMessage *inbound) {
+    {
+        SYNCHRONIZE;
+        auto position = qtfb::management::connections.find(connection->fbKey);
+        int slot = inbound->presentBuffer.slot;
+        if(position == qtfb::management::connections.end() || !position->second->imported ||
+           slot < 0 || slot >= QTFB_MAX_IMPORTED_BUFFERS || position->second->importedBuffers[slot].image == NULL) {
+            CERR << "Cannot present buffer " << slot << " - it has not been imported" << std::endl;
+            return RESP_ERR;
+        }
+        qtfb::management::ClientBackend *backend = position->second;
+        if(slot != backend->presentedSlot) {
+            presentImportedBuffer(backend, slot);
+            rebindController(connection->fbKey, backend->image, []() {});
+        }
+    }
+    // The rebind is queued ahead of the repaint.
+    qtfb::ClientMessage update = {
+        .type = MESSAGE_UPDATE,
+        .update = inbound->presentBuffer.update,
+    };
+    return handleUpdateRegion(connection, &update);
+}
+
+// recv() which also picks up an fd passed along with the message (-1 if there wasn't one).
+static ssize_t receiveMessage(int socketFD, qtfb::ClientMessage *message, int *passedFD) {
+    struct iovec data = {
+        .iov_base = message,
+        .iov_len = sizeof(*message),
+    };
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr header = {};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+
+    *passedFD = -1;
+    ssize_t received = recvmsg(socketFD, &header, MSG_CMSG_CLOEXEC);
+    if(received > 0) {
+        for(struct cmsghdr *item = CMSG_FIRSTHDR(&header); item != NULL; item = CMSG_NXTHDR(&header, item)) {
+            if(item->cmsg_level == SOL_SOCKET && item->cmsg_type == SCM_RIGHTS) {
+                memcpy(passedFD, CMSG_DATA(item), sizeof(int));
+            }
+        }
+    }
+    return received;
+}
+
 static void managementClientThread(int incomingFD) {
     qtfb::management::ClientConnection connection;
     connection.clientFD = incomingFD;
@@ -264,7 +920,11 @@ static void managementClientThread(int incomingFD) {
     CERR << "Connection established from client. Sock FD is " << incomingFD << std::endl;
     qtfb::ClientMessage inboundMessage;
     for(;;){
-        if(recv(incomingFD, &inboundMessage, sizeof(inboundMessage), 0) < 1) break;
+        int passedFD;
+        if(receiveMessage(incomingFD, &inboundMessage, &passedFD) < 1) break;
+        if(passedFD != -1 && inboundMessage.type != MESSAGE_IMPORT_BUFFER) {
+            close(passedFD);
+        }
         int status;
         switch(inboundMessage.type) {
             case MESSAGE_INITIALIZE:
@@ -274,6 +934,25 @@ static void managementClientThread(int incomingFD) {
             case MESSAGE_UPDATE:
                 status = handleUpdateRegion(&connection, &inboundMessage);
                 break;
+            case MESSAGE_RECONFIGURE:
+                status = handleReconfigure(&connection, &inboundMessage);
+                break;
+            case MESSAGE_IMPORT_BUFFER:
+                status = handleImportBuffer(&connection, &inboundMessage, passedFD);
+                break;
+            case MESSAGE_PRESENT_BUFFER:
+                status = handlePresentBuffer(&connection, &inboundMessage);
+                break;
+            case MESSAGE_OVERLAY:
+                status = handleOverlay(&connection, &inboundMessage);
+                break;
+            case MESSAGE_INK_ECHO:
+                status = handleInkEcho(&connection, &inboundMessage);
+                break;
+            case MESSAGE_REQUEST_FRAME_CREDITS:
+                enableFrameCredits(&connection);
+                status = RESP_OK;
+                break;
             case MESSAGE_TERMINATE:
                 CERR << "The client requested closing the connection." << std::endl;
                 goto close;
@@ -286,57 +965,72 @@ static void managementClientThread(int incomingFD) {
             goto close;
         }
     }
-    close: SYNCHRONIZE;
-    qtfb::management::ClientBackend *backendToKill = NULL;
-    if(connection.fbKey != -1) {
-        auto position = qtfb::management::connections.find(connection.fbKey);
-        if(position != qtfb::management::connections.end()){
-            // There can be more than one backend. Was this the last?
-            qtfb::management::ClientBackend *backend = qtfb::management::connections[connection.fbKey];
-            auto position2 = std::find(backend->connections.begin(), backend->connections.end(), &connection);
-            if(position2 != backend->connections.end()) {
-                backend->connections.erase(position2);
-            } else {
-                CERR << "Cannot erase connection in list!" << std::endl;
-            }
-            if(backend->connections.empty()) {
-                backendToKill = backend; // Delay destruction of the backend to after the (potential) object had dissotiated.
-                qtfb::management::connections.erase(position);
-            }
-        }
-    }
-
-    if(connection.fbKey != -1 && backendToKill){
-        if(qtfb::management::framebuffers.find(connection.fbKey) != qtfb::management::framebuffers.end()) {
-            // The client that died was associated with a framebuffer!
-            QPointer<FBController> controller = qtfb::management::framebuffers[connection.fbKey];
-            if(!controller.isNull()) {
-                // Disassociate
-                while(controller->isMidPaint) {
-                    usleep(1000);
-                    if(controller.isNull()) {
-                        // The controller had been removed as we were waiting for the repaint to stop
-                        goto continueDeletion;
+    close:
+    // Copied under the lock (the surface can be reused or unmapped right after), handed to the
+    // snapshots without it.
+    QImage snapshot;
+    {
+        SYNCHRONIZE;
+        if(connection.fbKey != -1) {
+            removeClientSocket(&connection);
+            auto position = qtfb::management::connections.find(connection.fbKey);
+            if(position != qtfb::management::connections.end()){
+                // There can be more than one backend. Was this the last?
+                qtfb::management::ClientBackend *backend = qtfb::management::connections[connection.fbKey];
+                auto position2 = std::find(backend->connections.begin(), backend->connections.end(), &connection);
+                if(position2 != backend->connections.end()) {
+                    backend->connections.erase(position2);
+                } else {
+                    CERR << "Cannot erase connection in list!" << std::endl;
+                }
+                if(backend->connections.empty()) {
+                    // Cursors and ink previews make no sense without their client.
+                    detachOverlay(backend, connection.fbKey);
+                    if(backend->image != NULL && qtfb::snapshots::isBound(connection.fbKey)) {
+                        snapshot = backend->image->copy();
                     }
                 }
-
-                controller->associateSHM(NULL);
-                CERR << "Disassociating framebuffer " << connection.fbKey << std::endl;
+                if(backend->connections.empty() && backend->imported) {
+                    // The buffers belong to the client - nothing is left to show once it's gone.
+                    qtfb::management::connections.erase(position);
+                    // Freed behind any rebind still queued for them.
+                    disassociateController(connection.fbKey, [backend]() {
+                        delete backend;
+                    });
+                } else if(backend->connections.empty()) {
+                    // Keep the surface associated for a while - the reaper will detach it if
+                    // no client reclaims it in time.
+                    qtfb::management::connections.erase(position);
+                    lingeringBackends[connection.fbKey] = {
+                        backend,
+                        std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_GRACE_PERIOD_MS),
+                    };
+                    reaperWakeup.notify_one();
+                }
             }
         }
     }
-
-    continueDeletion:
+    if(!snapshot.isNull()) {
+        qtfb::snapshots::capture(connection.fbKey, snapshot);
+    }
 
     CERR << "Closing client socket " << incomingFD << std::endl;
     close(incomingFD);
-    if(backendToKill != NULL) delete backendToKill;
 }
 
 qtfb::management::ClientBackend::~ClientBackend() {
+    if(imported) {
+        // image and shm point into one of these.
+        for(const ImportedBuffer &buffer : importedBuffers) {
+            freeImportedBuffer(buffer);
+        }
+        image = NULL;
+        shm = NULL;
+    }
+    delete overlay;
     delete image;
     if(shm != NULL) {
-        munmap(shm, shmSize);
+        munmap(shm, shmCapacity);
     }
     if(translationShm != NULL){
         delete[] translationShm;
@@ -345,6 +1039,9 @@ qtfb::management::ClientBackend::~ClientBackend() {
         FORMAT_SHM(shmName, shmKey);
         shm_unlink(shmName);
     }
+    if(shmFD != -1) {
+        close(shmFD);
+    }
 }
 
 static void managementMainThread(){
@@ -379,10 +1076,97 @@ static void managementMainThread(){
     }
 }
 
+static void preallocationThread(qtfb::FBKey key, int shmType) {
+    qtfb::management::ClientBackend *backend = new qtfb::management::ClientBackend();
+    {
+        SYNCHRONIZE;
+        if(qtfb::management::connections.find(key) != qtfb::management::connections.end() || lingeringBackends.find(key) != lingeringBackends.end()) {
+            delete backend;
+            return;
+        }
+        bool reused;
+        if(!createDefaultSHM(backend, shmType, reused)) {
+            delete backend;
+            return;
+        }
+    }
+    // Fault the pages in now, while the client process is still starting up.
+    memset(backend->shm, 0, backend->shmSize);
+
+    SYNCHRONIZE;
+    if(qtfb::management::connections.find(key) != qtfb::management::connections.end() || lingeringBackends.find(key) != lingeringBackends.end()) {
+        // The client was quicker than us.
+        retireBackend(backend);
+        return;
+    }
+    CERR << "Preallocated framebuffer " << key << std::endl;
+    lingeringBackends[key] = {
+        backend,
+        std::chrono::steady_clock::now() + std::chrono::milliseconds(SHM_PREALLOCATION_TIMEOUT_MS),
+        true,
+    };
+    reaperWakeup.notify_one();
+}
+
+void qtfb::management::preallocate(FBKey key, int shmType) {
+    if(key == -1) return;
+    std::thread thread(preallocationThread, key, shmType);
+    thread.detach();
+}
+
+// Detaches lingering surfaces nobody reclaimed in time and trims the SHM pool.
+static void managementReaperThread() {
+    std::unique_lock<std::mutex> lock(globalBackendsListMutex);
+    for(;;) {
+        auto now = std::chrono::steady_clock::now();
+        std::optional<qtfb::management::pool::TimePoint> nextDeadline;
+        for(auto position = lingeringBackends.begin(); position != lingeringBackends.end();) {
+            if(position->second.deadline > now) {
+                if(!nextDeadline || position->second.deadline < *nextDeadline) {
+                    nextDeadline = position->second.deadline;
+                }
+                position++;
+                continue;
+            }
+            CERR << "Framebuffer " << position->first << " was not reclaimed in time." << std::endl;
+            qtfb::management::ClientBackend *expired = position->second.backend;
+            if(position->second.preallocated) {
+                retireBackend(expired);
+            } else {
+                disassociateController(position->first, [expired]() {
+                    retireBackend(expired);
+                });
+            }
+            position = lingeringBackends.erase(position);
+        }
+        qtfb::management::pool::expire(now);
+        auto poolDeadline = qtfb::management::pool::nextExpiry();
+        if(poolDeadline && (!nextDeadline || *poolDeadline < *nextDeadline)) {
+            nextDeadline = poolDeadline;
+        }
+
+        if(nextDeadline) {
+            reaperWakeup.wait_until(lock, *nextDeadline);
+        } else {
+            reaperWakeup.wait(lock);
+        }
+    }
+}
+
 void qtfb::management::start(){
     srand(time(NULL));
+    // Power saving: cap how often framebuffers get repainted.
+    if(const char *maxFPS = getenv("QTFB_MAX_FPS")) {
+        FBController::setMaxFrameRate(atoi(maxFPS));
+    }
+    // Keep app snapshots across restarts.
+    if(const char *snapshotDirectory = getenv("QTFB_SNAPSHOT_DIR")) {
+        qtfb::snapshots::setSpillDirectory(snapshotDirectory);
+    }
     std::thread thread(managementMainThread);
     thread.detach();
+    std::thread reaperThread(managementReaperThread);
+    reaperThread.detach();
 }
 
 void qtfb::management::forwardUserInput(qtfb::FBKey key, struct qtfb::UserInputContents *input) {
@@ -399,3 +1183,42 @@ void qtfb::management::forwardUserInput(qtfb::FBKey key, struct qtfb::UserInputC
         }
     }
 }
+
+void qtfb::management::forwardVisibility(qtfb::FBKey key, int state) {
+    // Not under the backend list lock - see clientSockets.
+    const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+    if(state == VISIBILITY_VISIBLE) {
+        framebufferVisibility.erase(key);
+    } else {
+        framebufferVisibility[key] = state;
+    }
+    struct ServerMessage outbound = {
+        .type = MESSAGE_VISIBILITY,
+        .visibility = {
+            .state = state,
+        },
+    };
+    auto range = clientSockets.equal_range(key);
+    for(auto position = range.first; position != range.second; position++) {
+        // Same as frame credits, never block the GUI thread on a client that's behind. One that
+        // doesn't read its socket doesn't act on visibility changes either.
+        send(position->second->clientFD, &outbound, sizeof(outbound), MSG_DONTWAIT);
+    }
+}
+
+void qtfb::management::grantFrameCredit(qtfb::FBKey key) {
+    // Not under the backend list lock - see clientSockets. Only clients which asked for credits
+    // (MESSAGE_REQUEST_FRAME_CREDITS) get them - the others would never read them.
+    const std::lock_guard<std::mutex> lock(clientSocketsMutex);
+    struct ServerMessage outbound = {
+        .type = MESSAGE_FRAME_CREDIT,
+    };
+    auto range = clientSockets.equal_range(key);
+    for(auto position = range.first; position != range.second; position++) {
+        // Never block the GUI thread on a client that's behind. A full socket means earlier credits
+        // are still waiting to be read, and one is as good as many - dropping this one loses nothing.
+        if(position->second->frameCredits) {
+            send(position->second->clientFD, &outbound, sizeof(outbound), MSG_DONTWAIT);
+        }
+    }
+}
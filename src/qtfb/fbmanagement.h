@@ -1,7 +1,9 @@
+#pragma once
 #include <map>
 #include <vector>
 #include <QDebug>
 #include <QMetaObject>
+#include <QPoint>
 #include <QPointer>
 #include <thread>
 
@@ -21,6 +23,18 @@
 #define RESP_ERR 1
 #define RESP_OK 0
 
+// How long a framebuffer's surface outlives its last connection. A client that reconnects
+// under the same key within that window gets its old surface back, last frame included.
+#define SHM_GRACE_PERIOD_MS 3000
+// Retired SHM segments are pooled in buckets of this granularity...
+#define SHM_POOL_BUCKET_SIZE (1024 * 1024)
+// ...up to this many bytes in total...
+#define SHM_POOL_MAX_BYTES (48 * 1024 * 1024)
+// ...for at most this long.
+#define SHM_POOL_IDLE_EXPIRY_MS 60000
+// How long a surface preallocated by the launcher waits for its client to attach.
+#define SHM_PREALLOCATION_TIMEOUT_MS 30000
+
 namespace qtfb::management {
     class ClientBackend {
     public:
@@ -31,9 +45,28 @@ namespace qtfb::management {
         QImage *image = NULL;
         int shmType = -1;
         size_t shmSize = 0;
+        // Size of the SHM object / mapping. Can be larger than shmSize after
+        // the surface has been reconfigured to something smaller.
+        size_t shmCapacity = 0;
 
         std::vector<class ClientConnection *> connections;
 
+        // Small RGBA8888 surface the controller composites on top of this one.
+        ClientBackend *overlay = NULL;
+        QPoint overlayPosition;
+        bool overlayVisible = false;
+
+        // Set for surfaces living in buffers the client imported, instead of a server-allocated
+        // SHM. shm and image then point into the buffer being presented.
+        bool imported = false;
+        int presentedSlot = -1;
+        struct ImportedBuffer {
+            int fd = -1;
+            unsigned char *mapping = NULL;
+            size_t mappingSize = 0;
+            QImage *image = NULL;
+        } importedBuffers[QTFB_MAX_IMPORTED_BUFFERS];
+
         ~ClientBackend();
     };
 
@@ -41,6 +74,8 @@ namespace qtfb::management {
     public:
         int clientFD;
         int fbKey = -1;
+        // The client asked for MESSAGE_FRAME_CREDIT. Guarded by the client socket list's lock.
+        bool frameCredits = false;
     };
 
     static std::map<FBKey, QPointer<FBController>> framebuffers;
@@ -50,6 +85,19 @@ namespace qtfb::management {
     void unregisterController(FBKey key);
     bool isControllerAssociated(FBKey key);
 
+    // Allocates the surface for `key` in the background, before its client connects.
+    // The client's init then only has to attach to it.
+    void preallocate(FBKey key, int shmType);
+    // Hands the framebuffer's snapshot placeholder (see snapshots.h) to its controller, if
+    // both are there. GUI thread only.
+    void offerPlaceholder(FBKey key);
+    // The framebuffer's thumbnail (see thumbnails.h), or a null image if nothing is shown.
+    // GUI thread only.
+    QImage thumbnail(FBKey key);
+
     void forwardUserInput(qtfb::FBKey key, struct qtfb::UserInputContents *input);
+    void forwardVisibility(qtfb::FBKey key, int state);
+    // Tells the clients the last frame they submitted has been painted.
+    void grantFrameCredit(qtfb::FBKey key);
     void start();
 }
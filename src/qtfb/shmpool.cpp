@@ -0,0 +1,97 @@
+#include "shmpool.h"
+#include "log.h"
+#include <deque>
+#include <iostream>
+
+struct PooledSegment {
+    qtfb::management::ClientBackend *backend;
+    qtfb::management::pool::TimePoint retiredAt;
+};
+
+static std::map<size_t, std::deque<PooledSegment>> buckets;
+static size_t pooledBytes = 0;
+
+static inline size_t bucketOf(size_t size) {
+    return (size + SHM_POOL_BUCKET_SIZE - 1) / SHM_POOL_BUCKET_SIZE;
+}
+
+static void destroyOldest() {
+    auto oldest = buckets.end();
+    for(auto bucket = buckets.begin(); bucket != buckets.end(); bucket++) {
+        if(oldest == buckets.end() || bucket->second.front().retiredAt < oldest->second.front().retiredAt) {
+            oldest = bucket;
+        }
+    }
+    if(oldest == buckets.end()) return;
+    qtfb::management::ClientBackend *backend = oldest->second.front().backend;
+    oldest->second.pop_front();
+    if(oldest->second.empty()) {
+        buckets.erase(oldest);
+    }
+    pooledBytes -= backend->shmCapacity;
+    CERR << "Evicting pooled SHM " << backend->shmKey << " (" << backend->shmCapacity << " bytes)" << std::endl;
+    delete backend;
+}
+
+void qtfb::management::pool::retire(ClientBackend *backend) {
+    delete backend->image;
+    backend->image = NULL;
+    delete backend->overlay;
+    backend->overlay = NULL;
+    if(backend->shm == NULL || backend->shmCapacity > SHM_POOL_MAX_BYTES) {
+        delete backend;
+        return;
+    }
+    while(pooledBytes + backend->shmCapacity > SHM_POOL_MAX_BYTES) {
+        destroyOldest();
+    }
+    CERR << "Pooling SHM " << backend->shmKey << " (" << backend->shmCapacity << " bytes)" << std::endl;
+    pooledBytes += backend->shmCapacity;
+    buckets[bucketOf(backend->shmCapacity)].push_back({ backend, std::chrono::steady_clock::now() });
+}
+
+qtfb::management::ClientBackend *qtfb::management::pool::acquire(size_t shmSize) {
+    auto bucket = buckets.find(bucketOf(shmSize));
+    if(bucket == buckets.end()) return NULL;
+    // Prefer the most recently retired segment - it's the most likely to still be resident.
+    for(auto entry = bucket->second.rbegin(); entry != bucket->second.rend(); entry++) {
+        ClientBackend *backend = entry->backend;
+        if(backend->shmCapacity < shmSize) continue;
+        bucket->second.erase(std::next(entry).base());
+        if(bucket->second.empty()) {
+            buckets.erase(bucket);
+        }
+        pooledBytes -= backend->shmCapacity;
+        return backend;
+    }
+    return NULL;
+}
+
+void qtfb::management::pool::expire(TimePoint now) {
+    auto cutoff = now - std::chrono::milliseconds(SHM_POOL_IDLE_EXPIRY_MS);
+    for(auto bucket = buckets.begin(); bucket != buckets.end();) {
+        while(!bucket->second.empty() && bucket->second.front().retiredAt <= cutoff) {
+            ClientBackend *backend = bucket->second.front().backend;
+            bucket->second.pop_front();
+            pooledBytes -= backend->shmCapacity;
+            CERR << "Pooled SHM " << backend->shmKey << " expired" << std::endl;
+            delete backend;
+        }
+        if(bucket->second.empty()) {
+            bucket = buckets.erase(bucket);
+        } else {
+            bucket++;
+        }
+    }
+}
+
+std::optional<qtfb::management::pool::TimePoint> qtfb::management::pool::nextExpiry() {
+    std::optional<TimePoint> next;
+    for(const auto &bucket : buckets) {
+        TimePoint candidate = bucket.second.front().retiredAt + std::chrono::milliseconds(SHM_POOL_IDLE_EXPIRY_MS);
+        if(!next || candidate < *next) {
+            next = candidate;
+        }
+    }
+    return next;
+}
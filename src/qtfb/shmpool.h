@@ -0,0 +1,21 @@
+#pragma once
+#include <chrono>
+#include <optional>
+#include "fbmanagement.h"
+
+// Retired (but still mapped) SHM segments, bucketed by size. A new framebuffer of a similar
+// size gets one of those instead of paying for shm_open() / ftruncate() / mmap() and the page
+// faults all over again.
+// None of these functions lock - they're only ever called with the backend list lock held.
+namespace qtfb::management::pool {
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    // Takes ownership of the backend. Its image and overlay are dropped, the segment stays mapped.
+    void retire(ClientBackend *backend);
+    // Returns a pooled backend with at least `shmSize` bytes mapped, or NULL.
+    // The caller takes ownership of it.
+    ClientBackend *acquire(size_t shmSize);
+    // Destroys every segment that had been idle for longer than SHM_POOL_IDLE_EXPIRY_MS.
+    void expire(TimePoint now);
+    std::optional<TimePoint> nextExpiry();
+}
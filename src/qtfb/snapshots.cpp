@@ -0,0 +1,241 @@
+#include "snapshots.h"
+#include "fbmanagement.h"
+#include "log.h"
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#define SNAPSHOT_FILE_MAGIC 0x51534e50 // QSNP
+#define SNAPSHOT_FILE_VERSION 1
+// Framebuffer dimensions travel as uint16 in the protocol.
+#define SNAPSHOT_MAX_DIMENSION 0xFFFF
+
+struct Snapshot {
+    QByteArray data;
+    int width = 0, height = 0;
+    qsizetype bytesPerLine = 0;
+    QImage::Format format = QImage::Format_Invalid;
+    // For LRU eviction
+    uint64_t lastUse = 0;
+};
+
+static std::mutex snapshotsMutex;
+static std::map<QString, Snapshot> cache;
+static size_t cachedBytes = 0;
+static uint64_t useCounter = 0;
+static std::map<qtfb::FBKey, QString> boundApps;
+static std::map<qtfb::FBKey, QImage> placeholders;
+static QString spillDirectory;
+
+static QString spillPath(const QString &appID) {
+    QString name = appID;
+    for(QChar &character : name) {
+        if(!character.isLetterOrNumber() && character != '-' && character != '.') {
+            character = '_';
+        }
+    }
+    return spillDirectory + "/" + name + ".snapshot";
+}
+
+// Must be called with the snapshot lock held.
+static void store(const QString &appID, Snapshot &&snapshot) {
+    auto previous = cache.find(appID);
+    if(previous != cache.end()) {
+        cachedBytes -= previous->second.data.size();
+        cache.erase(previous);
+    }
+    if((size_t) snapshot.data.size() > SNAPSHOT_CACHE_MAX_BYTES) {
+        return;
+    }
+    while(cachedBytes + snapshot.data.size() > SNAPSHOT_CACHE_MAX_BYTES) {
+        auto oldest = cache.begin();
+        for(auto entry = cache.begin(); entry != cache.end(); entry++) {
+            if(entry->second.lastUse < oldest->second.lastUse) {
+                oldest = entry;
+            }
+        }
+        cachedBytes -= oldest->second.data.size();
+        cache.erase(oldest);
+    }
+    snapshot.lastUse = ++useCounter;
+    cachedBytes += snapshot.data.size();
+    cache[appID] = std::move(snapshot);
+}
+
+static void writeSpill(const QString &path, const Snapshot &snapshot) {
+    // Written next to the old one and renamed, so a crash never leaves half a snapshot behind.
+    QFile file(path + ".tmp");
+    if(!file.open(QIODevice::WriteOnly)) {
+        CERR << "Failed to write snapshot " << path.toStdString() << std::endl;
+        return;
+    }
+    QDataStream stream(&file);
+    stream << (quint32) SNAPSHOT_FILE_MAGIC << (quint32) SNAPSHOT_FILE_VERSION
+           << (qint32) snapshot.width << (qint32) snapshot.height << (qint64) snapshot.bytesPerLine
+           << (qint32) snapshot.format << snapshot.data;
+    file.close();
+    QFile::remove(path);
+    QFile::rename(path + ".tmp", path);
+}
+
+static bool readSpill(const QString &path, Snapshot &snapshot) {
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QDataStream stream(&file);
+    quint32 magic, version;
+    qint32 width, height, format;
+    qint64 bytesPerLine;
+    stream >> magic >> version;
+    if(magic != SNAPSHOT_FILE_MAGIC || version != SNAPSHOT_FILE_VERSION) {
+        return false;
+    }
+    stream >> width >> height >> bytesPerLine >> format >> snapshot.data;
+    if(stream.status() != QDataStream::Ok) {
+        return false;
+    }
+    // The file could be truncated, stale or just garbage - only accept what capture() could
+    // have produced.
+    int depth;
+    switch(format) {
+        case QImage::Format_RGB16: depth = 2; break;
+        case QImage::Format_RGB888: depth = 3; break;
+        case QImage::Format_RGBA8888: depth = 4; break;
+        default:
+            CERR << "Snapshot " << path.toStdString() << " has an unknown format " << format << std::endl;
+            return false;
+    }
+    if(width <= 0 || height <= 0 || width > SNAPSHOT_MAX_DIMENSION || height > SNAPSHOT_MAX_DIMENSION
+        || bytesPerLine < (qint64) width * depth || bytesPerLine > (qint64) width * depth + 3) {
+        CERR << "Snapshot " << path.toStdString() << " has invalid dimensions" << std::endl;
+        return false;
+    }
+    snapshot.width = width;
+    snapshot.height = height;
+    snapshot.bytesPerLine = bytesPerLine;
+    snapshot.format = (QImage::Format) format;
+    return true;
+}
+
+static QImage decode(const Snapshot &snapshot) {
+    QByteArray raw = qUncompress(snapshot.data);
+    if(raw.size() != snapshot.bytesPerLine * snapshot.height) {
+        return QImage();
+    }
+    QImage image(snapshot.width, snapshot.height, snapshot.format);
+    if(image.isNull()) {
+        return QImage();
+    }
+    qsizetype rowSize = std::min(snapshot.bytesPerLine, image.bytesPerLine());
+    for(int y = 0; y < snapshot.height; y++) {
+        memcpy(image.scanLine(y), raw.constData() + y * snapshot.bytesPerLine, rowSize);
+    }
+    return image;
+}
+
+void qtfb::snapshots::setSpillDirectory(const QString &directory) {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    spillDirectory = directory;
+    if(!directory.isEmpty()) {
+        QDir().mkpath(directory);
+    }
+}
+
+void qtfb::snapshots::bind(FBKey key, const QString &appID) {
+    if(key == -1) return;
+    {
+        std::lock_guard<std::mutex> lock(snapshotsMutex);
+        boundApps[key] = appID;
+    }
+    std::thread([key, appID]() {
+        Snapshot snapshot;
+        {
+            std::lock_guard<std::mutex> lock(snapshotsMutex);
+            auto position = cache.find(appID);
+            if(position != cache.end()) {
+                position->second.lastUse = ++useCounter;
+                snapshot = position->second;
+            } else if(spillDirectory.isEmpty() || !readSpill(spillPath(appID), snapshot)) {
+                return;
+            } else {
+                store(appID, Snapshot(snapshot));
+            }
+        }
+        QImage placeholder = decode(snapshot);
+        if(placeholder.isNull()) return;
+        {
+            std::lock_guard<std::mutex> lock(snapshotsMutex);
+            if(boundApps.find(key) == boundApps.end()) {
+                // The app is already gone again.
+                return;
+            }
+            placeholders[key] = placeholder;
+        }
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [key]() {
+            qtfb::management::offerPlaceholder(key);
+        }, Qt::QueuedConnection);
+    }).detach();
+}
+
+void qtfb::snapshots::unbind(FBKey key) {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    boundApps.erase(key);
+    placeholders.erase(key);
+}
+
+bool qtfb::snapshots::isBound(FBKey key) {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    return boundApps.find(key) != boundApps.end();
+}
+
+void qtfb::snapshots::capture(FBKey key, const QImage &image) {
+    QString appID;
+    {
+        std::lock_guard<std::mutex> lock(snapshotsMutex);
+        auto position = boundApps.find(key);
+        if(position == boundApps.end()) {
+            return;
+        }
+        appID = position->second;
+        boundApps.erase(position);
+        placeholders.erase(key);
+    }
+    QImage copy = image;
+    std::thread([appID, copy]() {
+        Snapshot snapshot;
+        snapshot.data = qCompress(copy.constBits(), copy.sizeInBytes(), SNAPSHOT_COMPRESSION_LEVEL);
+        snapshot.width = copy.width();
+        snapshot.height = copy.height();
+        snapshot.bytesPerLine = copy.bytesPerLine();
+        snapshot.format = copy.format();
+        QString path;
+        {
+            std::lock_guard<std::mutex> lock(snapshotsMutex);
+            if(!spillDirectory.isEmpty()) {
+                path = spillPath(appID);
+            }
+            store(appID, Snapshot(snapshot));
+        }
+        if(!path.isEmpty()) {
+            writeSpill(path, snapshot);
+        }
+        CERR << "Snapshot of " << appID.toStdString() << " taken (" << snapshot.data.size() << " bytes)" << std::endl;
+    }).detach();
+}
+
+QImage qtfb::snapshots::takePlaceholder(FBKey key) {
+    std::lock_guard<std::mutex> lock(snapshotsMutex);
+    auto position = placeholders.find(key);
+    if(position == placeholders.end()) {
+        return QImage();
+    }
+    QImage placeholder = position->second;
+    placeholders.erase(position);
+    return placeholder;
+}
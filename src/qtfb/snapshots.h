@@ -0,0 +1,30 @@
+#pragma once
+#include <QImage>
+#include <QString>
+#include "common.h"
+
+// Compressed copies of the last frame every app presented, keyed by app ID. When the app is
+// launched again, its window shows that frame right away instead of staying blank until the
+// client has started up and rendered. Snapshots are kept in memory and, if QTFB_SNAPSHOT_DIR
+// is set, also written there so they survive restarts of the app loader.
+#define SNAPSHOT_CACHE_MAX_BYTES (16 * 1024 * 1024)
+// zlib level. Snapshots are taken as apps go away - speed matters more than size.
+#define SNAPSHOT_COMPRESSION_LEVEL 1
+
+namespace qtfb::snapshots {
+    // Enables writing snapshots to (and reading them from) the directory. Empty disables it.
+    void setSpillDirectory(const QString &directory);
+    // The framebuffer `key` is about to be used by the app `appID`. Its last snapshot gets
+    // decoded in the background, then offered to the framebuffer's controller.
+    void bind(FBKey key, const QString &appID);
+    // Forgets the framebuffer's app (and any placeholder for it) without a snapshot - for when
+    // the app failed to launch, or its window went away.
+    void unbind(FBKey key);
+    // Whether the framebuffer is bound to an app - only then is a capture() worth a copy.
+    bool isBound(FBKey key);
+    // Snapshots the framebuffer's image, if it's bound to an app, and unbinds it. `image` must
+    // not refer to the SHM - pass a copy. Compression happens in the background.
+    void capture(FBKey key, const QImage &image);
+    // The decoded snapshot for the framebuffer - null if there's none (yet). Only returned once.
+    QImage takePlaceholder(FBKey key);
+}
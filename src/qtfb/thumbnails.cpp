@@ -0,0 +1,198 @@
+#include "thumbnails.h"
+#include "fbmanagement.h"
+#include <QCoreApplication>
+#include <QQmlEngine>
+#include <QThread>
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define THUMBNAILS_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define THUMBNAILS_SSE2
+#endif
+
+#define BLOCK_AREA (THUMBNAIL_SCALE * THUMBNAIL_SCALE)
+
+static_assert(THUMBNAIL_SCALE == 8, "The vectorized filters work on 8 pixel wide blocks");
+
+static inline uint32_t packAverage(unsigned r, unsigned g, unsigned b) {
+    return 0xFF000000 | ((r / BLOCK_AREA) << 16) | ((g / BLOCK_AREA) << 8) | (b / BLOCK_AREA);
+}
+
+#ifdef THUMBNAILS_NEON
+static inline unsigned horizontalSum(uint16x8_t value) {
+#ifdef __aarch64__
+    return vaddvq_u16(value);
+#else
+    uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(value));
+    return vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1);
+#endif
+}
+#endif
+
+// Averages of one THUMBNAIL_SCALE x THUMBNAIL_SCALE block, starting at `source`.
+static uint32_t averageRGBA8888(const unsigned char *source, qsizetype stride) {
+#if defined(THUMBNAILS_NEON)
+    uint16x8_t r = vdupq_n_u16(0), g = vdupq_n_u16(0), b = vdupq_n_u16(0);
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        uint8x8x4_t pixels = vld4_u8(source);
+        r = vaddw_u8(r, pixels.val[0]);
+        g = vaddw_u8(g, pixels.val[1]);
+        b = vaddw_u8(b, pixels.val[2]);
+    }
+    return packAverage(horizontalSum(r), horizontalSum(g), horizontalSum(b));
+#elif defined(THUMBNAILS_SSE2)
+    // Two pixels' worth of 16-bit channel sums per register.
+    __m128i zero = _mm_setzero_si128(), sum = _mm_setzero_si128();
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        __m128i left = _mm_loadu_si128((const __m128i *) source);
+        __m128i right = _mm_loadu_si128((const __m128i *) (source + 16));
+        sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(left, zero), _mm_unpackhi_epi8(left, zero)));
+        sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_unpacklo_epi8(right, zero), _mm_unpackhi_epi8(right, zero)));
+    }
+    sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+    uint16_t channels[8];
+    _mm_storeu_si128((__m128i *) channels, sum);
+    return packAverage(channels[0], channels[1], channels[2]);
+#else
+    unsigned r = 0, g = 0, b = 0;
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        for(int column = 0; column < THUMBNAIL_SCALE; column++) {
+            r += source[column * 4];
+            g += source[column * 4 + 1];
+            b += source[column * 4 + 2];
+        }
+    }
+    return packAverage(r, g, b);
+#endif
+}
+
+static uint32_t averageRGB888(const unsigned char *source, qsizetype stride) {
+#ifdef THUMBNAILS_NEON
+    uint16x8_t r = vdupq_n_u16(0), g = vdupq_n_u16(0), b = vdupq_n_u16(0);
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        uint8x8x3_t pixels = vld3_u8(source);
+        r = vaddw_u8(r, pixels.val[0]);
+        g = vaddw_u8(g, pixels.val[1]);
+        b = vaddw_u8(b, pixels.val[2]);
+    }
+    return packAverage(horizontalSum(r), horizontalSum(g), horizontalSum(b));
+#else
+    unsigned r = 0, g = 0, b = 0;
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        for(int column = 0; column < THUMBNAIL_SCALE; column++) {
+            r += source[column * 3];
+            g += source[column * 3 + 1];
+            b += source[column * 3 + 2];
+        }
+    }
+    return packAverage(r, g, b);
+#endif
+}
+
+static uint32_t averageRGB565(const unsigned char *source, qsizetype stride) {
+    unsigned r = 0, g = 0, b = 0;
+#ifdef THUMBNAILS_NEON
+    uint16x8_t r5 = vdupq_n_u16(0), g6 = vdupq_n_u16(0), b5 = vdupq_n_u16(0);
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        uint16x8_t pixels = vld1q_u16((const uint16_t *) source);
+        r5 = vaddq_u16(r5, vshrq_n_u16(pixels, 11));
+        g6 = vaddq_u16(g6, vandq_u16(vshrq_n_u16(pixels, 5), vdupq_n_u16(0x3F)));
+        b5 = vaddq_u16(b5, vandq_u16(pixels, vdupq_n_u16(0x1F)));
+    }
+    r = horizontalSum(r5);
+    g = horizontalSum(g6);
+    b = horizontalSum(b5);
+#else
+    for(int row = 0; row < THUMBNAIL_SCALE; row++, source += stride) {
+        const uint16_t *pixels = (const uint16_t *) source;
+        for(int column = 0; column < THUMBNAIL_SCALE; column++) {
+            r += pixels[column] >> 11;
+            g += (pixels[column] >> 5) & 0x3F;
+            b += pixels[column] & 0x1F;
+        }
+    }
+#endif
+    // Scale the 5 / 6-bit sums up to 8 bits per channel.
+    return packAverage(r * 255 / 31, g * 255 / 63, b * 255 / 31);
+}
+
+void qtfb::thumbnails::update(const QImage &surface, QImage &thumbnail, const QRect &damage) {
+    int width = surface.width() / THUMBNAIL_SCALE, height = surface.height() / THUMBNAIL_SCALE;
+    if(width == 0 || height == 0) {
+        thumbnail = QImage();
+        return;
+    }
+    QRect blocks;
+    if(thumbnail.width() != width || thumbnail.height() != height) {
+        thumbnail = QImage(width, height, QImage::Format_RGB32);
+        blocks = QRect(0, 0, width, height);
+    } else if(damage.isNull()) {
+        blocks = QRect(0, 0, width, height);
+    } else {
+        // Every block the damage touches, even partially.
+        int left = damage.x() / THUMBNAIL_SCALE, top = damage.y() / THUMBNAIL_SCALE;
+        int right = (damage.x() + damage.width() + THUMBNAIL_SCALE - 1) / THUMBNAIL_SCALE;
+        int bottom = (damage.y() + damage.height() + THUMBNAIL_SCALE - 1) / THUMBNAIL_SCALE;
+        blocks = QRect(left, top, right - left, bottom - top).intersected(QRect(0, 0, width, height));
+        if(blocks.isEmpty()) return;
+    }
+
+    uint32_t (*average)(const unsigned char *, qsizetype);
+    int bytesPerPixel;
+    switch(surface.format()) {
+        case QImage::Format_RGBA8888:
+            average = averageRGBA8888, bytesPerPixel = 4;
+            break;
+        case QImage::Format_RGB888:
+            average = averageRGB888, bytesPerPixel = 3;
+            break;
+        case QImage::Format_RGB16:
+            average = averageRGB565, bytesPerPixel = 2;
+            break;
+        default:
+            // Not something a qtfb client can produce - let Qt deal with it.
+            thumbnail = surface.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation).convertToFormat(QImage::Format_RGB32);
+            return;
+    }
+
+    qsizetype stride = surface.bytesPerLine();
+    for(int y = blocks.y(); y < blocks.y() + blocks.height(); y++) {
+        const unsigned char *row = surface.constScanLine(y * THUMBNAIL_SCALE);
+        uint32_t *output = (uint32_t *) thumbnail.scanLine(y);
+        for(int x = blocks.x(); x < blocks.x() + blocks.width(); x++) {
+            output[x] = average(row + x * THUMBNAIL_SCALE * bytesPerPixel, stride);
+        }
+    }
+}
+
+QImage qtfb::thumbnails::Provider::requestImage(const QString &id, QSize *size, const QSize &requestedSize) {
+    // "<key>" or "<key>/<anything>"
+    qtfb::FBKey key = id.section('/', 0, 0).toInt();
+    QImage thumbnail;
+    if(QThread::currentThread() == QCoreApplication::instance()->thread()) {
+        thumbnail = qtfb::management::thumbnail(key);
+    } else {
+        // Asynchronous Images are loaded on a separate thread, but the controllers (and their
+        // thumbnails) belong to the GUI thread.
+        QMetaObject::invokeMethod(QCoreApplication::instance(), [key, &thumbnail]() {
+            thumbnail = qtfb::management::thumbnail(key);
+        }, Qt::BlockingQueuedConnection);
+    }
+    if(!thumbnail.isNull() && requestedSize.isValid() && requestedSize != thumbnail.size()) {
+        thumbnail = thumbnail.scaled(requestedSize, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+    }
+    if(size) {
+        *size = thumbnail.size();
+    }
+    return thumbnail;
+}
+
+void qtfb::thumbnails::installProvider(QQmlEngine *engine) {
+    if(engine && !engine->imageProvider(THUMBNAIL_PROVIDER_ID)) {
+        // The engine takes ownership.
+        engine->addImageProvider(THUMBNAIL_PROVIDER_ID, new Provider());
+    }
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <QImage>
+#include <QQuickImageProvider>
+#include <QRect>
+
+// Small downscaled copies of the framebuffers, for task switchers and overviews. Every
+// FBController keeps one, and only re-filters the parts clients have updated since it was last
+// asked for it. QML gets them through an image provider:
+//
+//   Image { source: "image://qtfbthumbnail/" + qtfbKey + "/" + refreshCounter; cache: false }
+//
+// Anything after the key is ignored - change it to have the Image fetch a fresh thumbnail.
+// The Image may be asynchronous - the provider fetches the thumbnail on the GUI thread either way.
+#define THUMBNAIL_SCALE 8
+#define THUMBNAIL_PROVIDER_ID "qtfbthumbnail"
+
+class QQmlEngine;
+
+namespace qtfb::thumbnails {
+    // Box-filters the damaged rect of the surface (in surface pixels) into the thumbnail, which
+    // is 1/THUMBNAIL_SCALE of its size, in Format_RGB32. The thumbnail is reallocated (and
+    // filtered completely) if it doesn't match the surface.
+    void update(const QImage &surface, QImage &thumbnail, const QRect &damage);
+
+    class Provider : public QQuickImageProvider {
+    public:
+        Provider() : QQuickImageProvider(QQuickImageProvider::Image) {}
+        QImage requestImage(const QString &id, QSize *size, const QSize &requestedSize) override;
+    };
+
+    // Adds the provider to the engine, unless it's already there.
+    void installProvider(QQmlEngine *engine);
+}
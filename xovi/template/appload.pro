@@ -11,7 +11,7 @@ xoviextension.depends = appload.xovi
 QMAKE_EXTRA_TARGETS += xoviextension
 PRE_TARGETDEPS += xovi.cpp
 
-SOURCES += temporary/src/main.cpp xovi.cpp temporary/src/management.cpp temporary/src/AppLoad.cpp temporary/src/AppLoadCoordinator.cpp temporary/src/library.cpp temporary/src/libraryexternals.cpp temporary/src/qtfb/fbmanagement.cpp temporary/src/qtfb/FBController.cpp
+SOURCES += temporary/src/main.cpp xovi.cpp temporary/src/management.cpp temporary/src/AppLoad.cpp temporary/src/AppLoadCoordinator.cpp temporary/src/library.cpp temporary/src/libraryexternals.cpp temporary/src/qtfb/fbmanagement.cpp temporary/src/qtfb/FBController.cpp temporary/src/qtfb/shmpool.cpp temporary/src/qtfb/snapshots.cpp temporary/src/qtfb/thumbnails.cpp
 HEADERS += temporary/src/AppLoad.h temporary/src/AppLoadCoordinator.h temporary/src/library.h temporary/src/AppLibrary.h \
-            temporary/src/qtfb/FBController.h temporary/src/qtfb/fbmanagement.h
+            temporary/src/qtfb/FBController.h temporary/src/qtfb/fbmanagement.h temporary/src/qtfb/shmpool.h temporary/src/qtfb/snapshots.h temporary/src/qtfb/thumbnails.h
 